@@ -6,11 +6,15 @@
     Obtain Tempo color for a day, using the RTE API Tempo Like Supply Contract.
 
   Steps
-  1. Connect to a local network using Wifi.
-  2. Send an HTTP GET Request to the RTE API, to obtain an access Token.
-  3. Init the time system with a time zone string, to handle local times.
-  4. If current local time is required, call an NTP server to init the RTC clock.
-  5. Send HTTP¨GET requests to the RTE API, to obtain different Tempo colors.
+  1. Connect to a local network using Wifi (fast reconnect after a deep sleep).
+  2. Send an HTTP GET Request to the RTE API, to obtain an access Token
+     (cached in RTC memory and NVS, refreshed only when it expires or is rejected).
+  3. Init the time system with a time zone string, to handle local times
+     (parsed once, the DST changes of a year computed once, no newlib conversion).
+  4. Start an NTP synchronization of the RTC clock in parallel with step 2, and wait
+     for it only if current local time is required.
+  5. Send HTTP¨GET requests to the RTE API, to obtain the Tempo colors of date ranges
+     (one request for all the days of a range, only if a color is not in the NVS cache).
 
   NB
   - In steps 2 and 5, decode the JSON data sent by the RTE API.
@@ -33,173 +37,2566 @@
   - HTTPClient :
     . https://github.com/espressif/arduino-esp32/tree/master/libraries/HTTPClient/src
     . https://randomnerdtutorials.com/esp32-http-get-post-arduino/
+    . https://github.com/espressif/arduino-esp32/tree/master/libraries/WiFiClientSecure/src
+    . https://github.com/espressif/arduino-esp32/tree/master/libraries/WiFiClientSecure#using-a-root-certificate-authority-cert
   - ArduinoJSON :
     . https://github.com/bblanchon/ArduinoJson
     . https://arduinojson.org/v6/doc/
     . https://arduinojson.org/v6/assistant/
     . https://arduinojson.org/v6/how-to/use-arduinojson-with-httpclient/
 
+/***********************************************************************************
+  Build profile
+***********************************************************************************/
+
+// Profile (or -D TEMPO_PROFILE_SENSOR / -D TEMPO_PROFILE_GATEWAY in the build_flags of a PlatformIO env) :
+// features below, sizes and timeouts in the CONFIG constants, the other modes are not compiled
+// - SENSOR : battery powered, deep sleep between the RTE publications, short radio-on time
+// - GATEWAY : mains powered, service task, LAN server and MQTT for the other devices of the site
+// - none : one-shot run, features chosen one by one with their own -D flags
+// #define TEMPO_PROFILE_SENSOR
+// #define TEMPO_PROFILE_GATEWAY
+#if defined(TEMPO_PROFILE_SENSOR) && defined(TEMPO_PROFILE_GATEWAY)
+#error "TEMPO_PROFILE_SENSOR and TEMPO_PROFILE_GATEWAY are exclusive"
+#endif
+#ifdef TEMPO_PROFILE_SENSOR
+#define DEEP_SLEEP_SCHEDULER
+#define WIFI_STATIC_IP
+#endif
+#ifdef TEMPO_PROFILE_GATEWAY
+#define TEMPO_SERVICE_TASK
+#define LAN_SERVER
+#define MQTT_PUBLISH
+#endif
+
 /***********************************************************************************
   Libraries and types
 ***********************************************************************************/
 
-#include <WiFi.h>
-#include <time.h>
-#include <HTTPClient.h>
-#include <ArduinoJson.h>
+#include <WiFi.h>
+#include <time.h>
+#include <WiFiClientSecure.h>
+#include <HTTPClient.h>
+#include <ArduinoJson.h>
+#include <Preferences.h>
+#include <esp_sleep.h>
+#include <esp_sntp.h>
+#include <limits>
+#ifdef LAN_SERVER
+#include <WebServer.h>
+#endif
+#ifdef MQTT_PUBLISH
+#include <mqtt_client.h>
+#endif
+#ifdef TEMPO_SERVICE_TASK
+#include <esp_idf_version.h>
+#include <esp_task_wdt.h>
+#endif
+
+// Access token (kept in RTC memory, saved in NVS)
+struct TokenCache
+{
+  char token[128];
+  time_t expiry;  // UTC, 0 if unknown (clock not set when the token was obtained)
+};
+
+// Daylight saving time change : day of the week (0 = Sunday) of the week (1 to 5, 5 = last) of the month, at a local time
+struct TransitionRule
+{
+  int month, week, weekday;
+  long time;  // s, local time before the change
+};
+
+// Time zone parsed once from a POSIX TZ string, with the UTC instants of the changes of one year
+struct TimeZone
+{
+  long stdOffset, dstOffset;  // s east of UTC (3600 for CET)
+  bool hasDST;
+  TransitionRule dstStart, dstEnd;
+  int year;                   // Year of the cached instants, 0 if none
+  time_t yearStart, yearEnd;  // UTC (standard time), for a quick check of the year
+  time_t dstStartUTC, dstEndUTC;
+};
+
+// Local time conversion result
+enum class LocalTimeKind : uint8_t {UNIQUE, AMBIGUOUS, NONEXISTENT};
+
+// Tempo color (value = cache code)
+enum class TempoColor : uint8_t {UNDEFINED, BLUE, WHITE, RED};
+
+constexpr bool isSameText(const char *text1, const char *text2)
+{
+  return (*text1 == *text2) && (*text1 == 0 || isSameText(text1+1, text2+1));
+}
+
+constexpr TempoColor parseTempoColor(const char *value)
+{
+  // Color from the JSON value ("BLUE", "WHITE" or "RED")
+  return (value == nullptr) ? TempoColor::UNDEFINED :
+    (value[0] == 'B' && isSameText(value, "BLUE")) ? TempoColor::BLUE :
+    (value[0] == 'W' && isSameText(value, "WHITE")) ? TempoColor::WHITE :
+    (value[0] == 'R' && isSameText(value, "RED")) ? TempoColor::RED : TempoColor::UNDEFINED;
+}
+static_assert(parseTempoColor("WHITE") == TempoColor::WHITE && parseTempoColor("REDS") == TempoColor::UNDEFINED, "parseTempoColor");
+
+// Sizes (bytes, samples, days) and timeouts (ms) of a build profile
+struct Config
+{
+  unsigned long wifiTimeout, ntpTimeout, httpTimeout, mqttTimeout;
+  size_t jsonArenaSize;   // One values[] element or the token
+  size_t urlSize;         // Request URL
+  size_t authorizationSize;  // Authorization header value (scheme and credentials)
+  int metricsSamples;
+  int prefetchChunk;      // Days per season prefetch request
+  int maxAttempts;        // Per request
+  int requestBudget;      // Requests per hour
+  unsigned long servicePeriod, heartbeatPeriod;
+};
+
+// Tempo color of a day
+struct TempoDay
+{
+  char date[11];      // YYYY-MM-DD
+  TempoColor color;
+};
+
+// Tariff period, until the start of the next one
+struct TariffPeriod
+{
+  time_t start;      // UTC
+  TempoColor color;  // Color of the Tempo day (06:00 to 06:00 local time)
+  bool peak;         // HP (heures pleines), else HC (heures creuses)
+};
+
+// Tempo colors of a season (1st of September to 31th of August), 2 bits per day, saved in NVS
+struct SeasonCache
+{
+  int season;           // Year of the 1st of September, 0 if not loaded
+  uint8_t colors[92];   // Day i of the season in bits 2*(i%4) of byte i/4 : 0 unknown, 1 BLUE, 2 WHITE, 3 RED
+  bool dirty;           // Not yet saved
+};
+
+// Colors of a season read from NVS without loading it (LAN requests)
+struct SeasonView
+{
+  int season;           // 0 if not read
+  uint8_t colors[92];   // As in SeasonCache
+};
+
+// Last Wifi connection (RTC memory), for a fast reconnect after a deep sleep
+struct WifiCache
+{
+  bool valid;
+  uint8_t bssid[6];
+  int32_t channel;
+  uint32_t ip, gateway, subnet, dns;
+};
+
+// Validators of the last calendar response (RTC memory), for a conditional request
+struct ConditionalCache
+{
+  long startN, endN;  // Window (day numbers)
+  char etag[64];
+  char lastModified[32];
+};
+
+// Scheduler state (RTC memory)
+struct SchedulerState
+{
+  int retries;  // Consecutive wakes without the J+1 color
+};
+
+// ArduinoJson allocator over a fixed arena : deterministic memory, no heap fragmentation
+class ArenaAllocator : public ArduinoJson::Allocator
+{
+public:
+  ArenaAllocator(uint8_t *arena, const size_t size) : _arena(arena), _size(size) {}
+  void *allocate(size_t size) override
+  {
+    size = align(size);
+    if (_top + HEADER + size > _size) return nullptr;  // Decoding fails with NoMemory
+    uint8_t *ptr = _arena + _top + HEADER;
+    *(size_t *)(ptr - HEADER) = size;
+    _last = ptr;
+    _top += HEADER + size;
+    _highWater = max(_highWater, _top);
+    _count++;
+    return ptr;
+  }
+  void deallocate(void *ptr) override
+  {
+    // Stack like : the last block is freed, the others when the document is cleared
+    if (ptr == nullptr) return;
+    if (ptr == _last) _top = _last - HEADER - _arena;
+    if (--_count == 0) _top = 0;
+    _last = nullptr;
+  }
+  void *reallocate(void *ptr, size_t size) override
+  {
+    if (ptr == nullptr) return allocate(size);
+    size = align(size);
+    size_t *sizePtr = (size_t *)((uint8_t *)ptr - HEADER);
+    if (ptr == _last)
+    {
+      // In place
+      size_t top = (uint8_t *)ptr - _arena + size;
+      if (top > _size) return nullptr;
+      *sizePtr = size;
+      _top = top;
+      _highWater = max(_highWater, _top);
+      return ptr;
+    }
+    if (size <= *sizePtr) return ptr;
+    void *newPtr = allocate(size);
+    if (newPtr == nullptr) return nullptr;
+    memcpy(newPtr, ptr, *sizePtr);
+    _count--;  // Old block lost until the document is cleared
+    return newPtr;
+  }
+  size_t highWater() const { return _highWater; }
+  size_t size() const { return _size; }
+  static const size_t HEADER = 8;  // Block size
+
+private:
+  static size_t align(const size_t size) { return (size + 7) & ~(size_t)7; }
+  uint8_t *_arena;
+  size_t _size;
+  size_t _top = 0;
+  size_t _highWater = 0;
+  uint8_t *_last = nullptr;
+  int _count = 0;
+};
+
+// Stream over a text in memory (recorded payloads, without network)
+class MemoryStream : public Stream
+{
+public:
+  MemoryStream(const char *text, const size_t size) : _text(text), _size(size) {}
+  int available() override { return _size - _position; }
+  int read() override { return (_position < _size) ? (uint8_t)_text[_position++] : -1; }
+  int peek() override { return (_position < _size) ? (uint8_t)_text[_position] : -1; }
+  size_t write(uint8_t) override { return 0; }
+  void rewind() { _position = 0; }
+
+private:
+  const char *_text;
+  size_t _size;
+  size_t _position = 0;
+};
+
+// Request phases (metrics)
+enum Phase {PHASE_DNS, PHASE_CONNECT, PHASE_FIRST_BYTE, PHASE_BODY, PHASE_COUNT};
+
+// Wake stages (energy profile)
+enum Stage {STAGE_WIFI, STAGE_NTP, STAGE_TOKEN, STAGE_CALENDAR, STAGE_COUNT};
+
+// Energy of the wakes of a day (RTC memory, saved in NVS)
+struct EnergyDay
+{
+  long day;                         // Local day number, 0 if none
+  uint32_t wakes;
+  uint64_t stageUs[STAGE_COUNT];
+  uint64_t radioUs, activeUs, sleepUs;
+  float mAh;                        // Estimated charge
+};
+
+// Days [startN, endN[ requested to the service task
+struct DayRange
+{
+  long startN, endN;
+};
+
+// Answer of the fleet peers : none reachable above this node, colors received, or being fetched by the peer
+enum PeerAnswer : uint8_t {PEER_NONE, PEER_DONE, PEER_PENDING};
+
+// Tempo service task states (bounded steps)
+enum ServiceState {SERVICE_CONNECT, SERVICE_START, SERVICE_WAIT, SERVICE_CHECK};
+
+// Body of an HTTP response, read directly from the connection (chunked transfer encoding, Content-Length, or until closed)
+class HttpBodyStream : public Stream
+{
+public:
+  HttpBodyStream(Stream *streamPtr, const int size, const bool chunked) :
+    _streamPtr(streamPtr), _chunked(chunked), _remaining(chunked ? 0 : size < 0 ? std::numeric_limits<long>::max() : size), _done(!chunked && size == 0)
+  {
+    setTimeout(0);  // The connection timeout applies
+  }
+  int available() override { return (_done) ? 0 : 1; }
+  int read() override
+  {
+    int c = peek();
+    _peeked = -1;
+    return c;
+  }
+  int peek() override
+  {
+    if (_peeked >= 0 || _done) return _peeked;
+    char c;
+    if ((_remaining == 0 && !(_chunked && nextChunk())) || _streamPtr->readBytes(&c, 1) != 1)
+    {
+      _done = true;
+      return -1;
+    }
+    _remaining--;
+    _peeked = (uint8_t)c;
+    return _peeked;
+  }
+  void drain()
+  {
+    // Read the end of the body, to reuse the connection
+    while (read() >= 0);
+  }
+  size_t write(uint8_t) override { return 0; }
+
+private:
+  bool nextChunk()
+  {
+    // Chunk size line (after the CRLF ending the previous chunk), then the last chunk is empty
+    long size = 0;
+    bool digits = false, extension = false;
+    char c;
+    while (true)
+    {
+      if (_streamPtr->readBytes(&c, 1) != 1) return false;
+      if (c == '\n') { if (digits) break; else continue; }
+      if (extension || !isxdigit(c)) { extension |= (c == ';'); continue; }
+      size = 16*size + (isdigit(c) ? c-'0' : tolower(c)-'a'+10);
+      digits = true;
+    }
+    if (size == 0)
+    {
+      char crlf[2];
+      _streamPtr->readBytes(crlf, 2);
+      return false;
+    }
+    _remaining = size;
+    return true;
+  }
+  Stream *_streamPtr;
+  bool _chunked;
+  long _remaining;
+  bool _done;
+  int _peeked = -1;
+};
+
+#if defined(METRICS) && defined(LAN_SERVER)
+// Text printed in a fixed buffer (truncated when full, always null terminated)
+class BufferPrint : public Print
+{
+public:
+  BufferPrint(char *buf, const size_t size) : _buf(buf), _size(size), _length(0) { _buf[0] = 0; }
+  size_t write(uint8_t c) override
+  {
+    if (_length + 1 >= _size) return 0;
+    _buf[_length++] = c;
+    _buf[_length] = 0;
+    return 1;
+  }
+  size_t write(const uint8_t *buf, size_t size) override
+  {
+    size_t n = 0;
+    while (n < size && write(buf[n])) n++;
+    return n;
+  }
+private:
+  char *_buf;
+  size_t _size, _length;
+};
+#endif
+
+/***********************************************************************************
+  Constants
+***********************************************************************************/
+
+// Calendar request URL : base, then the start and end dates (YYYY-MM-DDT00:00:00+hh:mm, 25 characters)
+constexpr char CALENDAR_BASE_URL[] = "https://digital.iservices.rte-france.com/open_api/tempo_like_supply_contract/v1/tempo_like_calendars?start_date=";
+constexpr size_t CALENDAR_URL_SIZE = sizeof(CALENDAR_BASE_URL) + 25 + sizeof("&end_date=")-1 + 25;  // With the final null
+
+// Build profile configuration (see above)
+#if defined(TEMPO_PROFILE_SENSOR)
+constexpr Config CONFIG =
+{
+  8000,   // wifiTimeout
+  3000,   // ntpTimeout
+  3000,   // httpTimeout
+  2000,   // mqttTimeout
+  3072,   // jsonArenaSize
+  176,    // urlSize
+  160,    // authorizationSize
+  16,     // metricsSamples
+  31,     // prefetchChunk
+  3,      // maxAttempts
+  10,     // requestBudget
+  60000,  // servicePeriod
+  300000  // heartbeatPeriod
+};
+#elif defined(TEMPO_PROFILE_GATEWAY)
+constexpr Config CONFIG =
+{
+  15000,  // wifiTimeout
+  10000,  // ntpTimeout
+  5000,   // httpTimeout
+  5000,   // mqttTimeout
+  4096,   // jsonArenaSize
+  200,    // urlSize
+  160,    // authorizationSize
+  64,     // metricsSamples
+  92,     // prefetchChunk
+  4,      // maxAttempts
+  30,     // requestBudget
+  60000,  // servicePeriod
+  300000  // heartbeatPeriod
+};
+#else
+constexpr Config CONFIG =
+{
+  10000,  // wifiTimeout
+  5000,   // ntpTimeout
+  1000,   // httpTimeout
+  3000,   // mqttTimeout
+  4096,   // jsonArenaSize
+  200,    // urlSize
+  160,    // authorizationSize
+  64,     // metricsSamples
+  31,     // prefetchChunk
+  4,      // maxAttempts
+  30,     // requestBudget
+  60000,  // servicePeriod
+  300000  // heartbeatPeriod
+};
+#endif
+// Smallest JSON arena : a slot pool (allocated whole by ArduinoJson 7, slots of 16 bytes before 7.2, 8 since),
+// then the token string while it grows (capacity doubled), with the node headers and the kept keys
+#if ARDUINOJSON_VERSION_MAJOR != 7
+#error "ArduinoJson 7 required"
+#endif
+constexpr size_t JSON_SLOT_SIZE = (ARDUINOJSON_VERSION_MINOR < 2) ? 16 : 8;
+constexpr size_t JSON_ARENA_MIN = ArenaAllocator::HEADER + ARDUINOJSON_POOL_CAPACITY*JSON_SLOT_SIZE
+  + ArenaAllocator::HEADER + 2*sizeof(TokenCache::token) + 64;
+static_assert(CONFIG.jsonArenaSize >= JSON_ARENA_MIN && CONFIG.urlSize >= CALENDAR_URL_SIZE && CONFIG.metricsSamples > 0, "CONFIG");
+
+// Serial port
+const unsigned long SERIAL_TIMEOUT = 2000;  // USB CDC host wait (ms), a headless unit starts anyway
+const unsigned long HEALTH_PERIOD = 600000; // Health printed on serial by a long running service (ms)
+
+// Local network access point
+const char *SSID = "--------";
+const char *PWD = "--------"; 
+constexpr unsigned long WIFI_TIMEOUT = CONFIG.wifiTimeout;  // Connection timeout (ms)
+// #define WIFI_STATIC_IP                  // Fast reconnect also skips DHCP, reusing the last lease
+
+// NTP server (=>UTC time) and Time zone
+const char* NTP_SERVER = "pool.ntp.org";  // Server address (or "ntp.obspm.fr", "ntp.unice.fr", ...) 
+const char* TIME_ZONE = "CET-1CEST,M3.5.0,M10.5.0/3"; // Europe/Paris time zone 
+constexpr unsigned long NTP_TIMEOUT = CONFIG.ntpTimeout;  // ms
+const long RTC_DRIFT_PPM = 200;          // RTC clock drift, mainly in deep sleep
+const long DRIFT_BUDGET = 2;             // Allowed RTC clock error (s) before an NTP synchronization
+
+// RTE API host and basic authorization
+const char *RTE_HOST = "digital.iservices.rte-france.com";
+const char *AUTH = "--------";
+
+// Root certificate of the RTE API host (PEM), pinned if PINNED_ROOT_CA is defined (or -D PINNED_ROOT_CA in build_flags)
+// #define PINNED_ROOT_CA
+const char *RTE_ROOT_CA =
+  "-----BEGIN CERTIFICATE-----\n"
+  "--------\n"
+  "-----END CERTIFICATE-----\n";
+const unsigned long TLS_HANDSHAKE_TIMEOUT = 10;  // s
+
+// HTTP response timeout (ms)
+constexpr unsigned long HTTP_TIMEOUT = CONFIG.httpTimeout;
+
+// Access token refreshed when it expires in less than TOKEN_MARGIN seconds
+const long TOKEN_MARGIN = 300;
+
+// Deep sleep scheduler (or -D DEEP_SLEEP_SCHEDULER in build_flags) : wake after midnight and after the J+1 publication
+// #define DEEP_SLEEP_SCHEDULER
+const int MIDNIGHT_WAKE_MINUTE = 5;                         // 00:05
+const int PUBLICATION_HOUR = 10, PUBLICATION_MINUTE = 45;   // RTE publishes J+1 around 10:40-11:00
+const long RETRY_FIRST = 300, RETRY_MAX = 3600;             // Backoff (s) while J+1 (or a published day) is missing
+
+// Tempo service task on core 0 (or -D TEMPO_SERVICE_TASK in build_flags) : the application never blocks on RTE
+// #define TEMPO_SERVICE_TASK
+constexpr unsigned long SERVICE_PERIOD = CONFIG.servicePeriod;  // J and J+1 check (ms)
+const int PENDING_RANGES = 8;                                   // Requested ranges not handled yet
+#if defined(TEMPO_SERVICE_TASK) && defined(DEEP_SLEEP_SCHEDULER)
+#error "TEMPO_SERVICE_TASK and DEEP_SLEEP_SCHEDULER are exclusive"
+#endif
+const uint32_t WATCHDOG_TIMEOUT = 90;  // Task watchdog (s) : longer than any step of the service task or the loop
+
+// Request retries : jittered exponential backoff (timeouts, 5xx), Retry-After (429), new token (401)
+constexpr int MAX_ATTEMPTS = CONFIG.maxAttempts;
+const unsigned long BACKOFF_FIRST = 1000, BACKOFF_MAX_WAIT = 30000;  // ms, longer waits are left to the caller
+constexpr int REQUEST_BUDGET = CONFIG.requestBudget;                 // Requests per hour, for all the retries
+const int HTTP_BUDGET_EXCEEDED = -100;                               // Besides the HTTPClient errors (<0)
+
+// LAN API server (or -D LAN_SERVER in build_flags) : cached colors for the other devices of the site, kept up to date by the service task
+// GET /tempo (J and J+1), GET /tempo/range?start=YYYY-MM-DD&end=YYYY-MM-DD (end excluded, at most one season)
+// #define LAN_SERVER
+const int LAN_SERVER_PORT = 80;
+#if defined(LAN_SERVER) && !defined(TEMPO_SERVICE_TASK)
+#error "LAN_SERVER requires TEMPO_SERVICE_TASK"
+#endif
+
+// Fleet mode (or -D FLEET_MODE in build_flags) : the nodes of a site (LAN servers, this one included) ask a peer before RTE
+// Leader : the reachable peer of highest rendezvous hash, the only one that calls RTE (the next one takes over when it is down)
+// A peer answers once the published days asked (until its current day) are known, else 503 while its service task fetches them
+// #define FLEET_MODE
+const char *FLEET_PEERS[] = {"192.168.1.--", "192.168.1.--", "192.168.1.--"};  // Same list on every node
+const char *FLEET_SITE = "--------";         // Hash key
+const unsigned long PEER_TIMEOUT = 1000;     // Connection and response (ms)
+const unsigned long PEER_RETRY = 60000;      // Down peer skipped (ms)
+const int N_PEERS = sizeof(FLEET_PEERS)/sizeof(FLEET_PEERS[0]);
+#if defined(FLEET_MODE) && !defined(LAN_SERVER)
+#error "FLEET_MODE requires LAN_SERVER"
+#endif
+#if defined(FLEET_MODE) && !defined(TEMPO_SERVICE_TASK)
+#error "FLEET_MODE requires TEMPO_SERVICE_TASK"
+#endif
+
+// MQTT publisher (or -D MQTT_PUBLISH in build_flags) : retained J and J+1 colors, published when they change, and a heartbeat
+// #define MQTT_PUBLISH
+const char *MQTT_URI = "mqtt://--------:1883";
+const char *MQTT_TOPIC_J = "tempo/J", *MQTT_TOPIC_J1 = "tempo/J+1", *MQTT_TOPIC_STATUS = "tempo/status";
+constexpr unsigned long HEARTBEAT_PERIOD = CONFIG.heartbeatPeriod;  // ms
+constexpr unsigned long MQTT_TIMEOUT = CONFIG.mqttTimeout;          // Connection, then acknowledgements (ms) before a deep sleep
+
+// Benchmark and checks (or -D BENCHMARK in build_flags) : decoding, URL formatting, cache and DST, without network
+// On the target only : the decoders write the NVS cache and the timings use esp_timer (no host build)
+// #define BENCHMARK
+
+// Request metrics (or -D METRICS in build_flags) : duration of each phase and minimum free heap, over the last METRICS_SAMPLES requests
+// Printed with the health of a long running service, and served by GET /metrics with LAN_SERVER
+// #define METRICS
+constexpr int METRICS_SAMPLES = CONFIG.metricsSamples;
+
+// Energy profile (or -D ENERGY_PROFILE in build_flags) : radio-on, active and deep sleep times of each wake, and an estimated charge,
+// summed per day in NVS (last ENERGY_DAYS days). Currents of the board (mA) : measure them, the deep sleep current of a
+// DevKitC is mostly its regulator and USB bridge
+// #define ENERGY_PROFILE
+const float CURRENT_RADIO = 110, CURRENT_ACTIVE = 45, CURRENT_SLEEP = 0.15;  // Wifi on, CPU only, deep sleep
+const int ENERGY_DAYS = 7;
+#if defined(ENERGY_PROFILE) && defined(TEMPO_SERVICE_TASK)
+#error "ENERGY_PROFILE accounts wakes, TEMPO_SERVICE_TASK never sleeps"
+#endif
+
+// Conditional calendar requests (or -D CONDITIONAL_FETCH in build_flags) : ETag and Last-Modified of the last response
+// #define CONDITIONAL_FETCH
+
+// Delta calendar decoder (or -D DELTA_DECODE in build_flags) : values[] scanned without any JSON document,
+// only the new or changed days written to the cache
+// #define DELTA_DECODE
+
+// Season prefetch : days per range request
+constexpr int PREFETCH_CHUNK = CONFIG.prefetchChunk;
+
+// Tempo days per season (RED and WHITE, the others are BLUE)
+const int SEASON_RED_DAYS = 22, SEASON_WHITE_DAYS = 43;
+
+// Tariff periods (local time) : the Tempo day starts at 06:00, HP from 06:00 to 22:00, HC from 22:00 to 06:00
+const int TEMPO_DAY_HOUR = 6, OFFPEAK_HOUR = 22;
+const int TARIFF_PERIODS = 9;  // Before J-1, HP and HC of J-1, J and J+1, after J+1, end
+
+// JSON document arena : one values[] element (decoded one at a time, whatever the number of days) or the token
+constexpr size_t JSON_ARENA_SIZE = CONFIG.jsonArenaSize;
+
+// Heap allocations counter (or -D DEBUG_HEAP_COUNT -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc in build_flags)
+// Per calendar fetch : never 0, HTTPClient allocates for each request
+// #define DEBUG_HEAP_COUNT
+
+// Color names, by TempoColor value
+const char *COLOR_NAMES[] = {"UNDEFINED", "BLUE", "WHITE", "RED"};
+
+// Debug print (or -D DEBUG_PRINT in build_flags), decoded JSON pretty printed on DEBUG_SINK
+// #define DEBUG_PRINT
+#ifndef DEBUG_SINK
+#define DEBUG_SINK Serial
+#endif
+
+/***********************************************************************************
+  Global variables
+***********************************************************************************/
+
+WiFiClientSecure client;  // Persistent TLS connection to the RTE API host
+HTTPClient http;
+String requestURL, requestAuthorization;  // Reserved once, reused by every request
+const String AUTHORIZATION_HEADER = "Authorization", ACCEPT_HEADER = "Accept", JSON_TYPE = "application/json";
+alignas(8) static uint8_t jsonArena[JSON_ARENA_SIZE];
+ArenaAllocator jsonAllocator(jsonArena, sizeof(jsonArena));
+JsonDocument doc(&jsonAllocator); 
+Preferences prefs;  // NVS
+TimeZone zone;      // TIME_ZONE, for the local times without newlib (owner of the network in task mode)
+RTC_DATA_ATTR WifiCache wifiCache;
+RTC_DATA_ATTR TokenCache tokenCache;
+RTC_DATA_ATTR time_t lastTimeSync;  // UTC of the last NTP synchronization
+bool timeSyncStarted = false;
+volatile bool timeSynced = false;
+long tokenExpiresIn = 0;             // Token obtained before the RTC was set : expiry computed later
+unsigned long tokenMillis;
+RTC_DATA_ATTR SeasonCache seasonCache;
+RTC_DATA_ATTR SchedulerState schedulerState;
+RTC_DATA_ATTR ConditionalCache conditionalCache;
+RTC_DATA_ATTR long budgetHour;   // Hour (UTC) of the request budget
+RTC_DATA_ATTR int budgetCount;   // Requests in this hour
+uint32_t retryCount = 0;
+uint32_t cacheHits = 0, cacheMisses = 0;  // Color ranges answered from the cache, or with a request
+uint32_t fetchErrors = 0;
+time_t lastFetch = 0;                     // UTC of the last successful request (RTE or peer), 0 if none
+#ifdef LAN_SERVER
+WebServer server(LAN_SERVER_PORT);
+#endif
+#ifdef FLEET_MODE
+WiFiClient peerClient;  // Plain HTTP on the LAN
+HTTPClient peerHttp;
+unsigned long peerDownMillis[N_PEERS];  // Last failure, 0 if none
+#endif
+#ifdef MQTT_PUBLISH
+esp_mqtt_client_handle_t mqttClient;
+volatile bool mqttConnected = false;
+RTC_DATA_ATTR TempoDay published[2];  // Last J and J+1 messages acknowledged by the broker
+TempoDay pendingDays[2];              // J and J+1 messages sent, not yet acknowledged
+int pendingIds[2];                    // Their message ids (0 if none)
+unsigned long pendingMillis[2];       // Their sending time
+volatile int ackedIds[4];             // Last acknowledged message ids (ring, written by the MQTT task)
+volatile uint8_t nAcked;
+unsigned long lastHeartbeat;
+#endif
+#ifdef METRICS
+struct Samples
+{
+  uint32_t count;
+  uint32_t values[METRICS_SAMPLES];  // Last values (ring)
+};
+const char *PHASE_NAMES[] = {"DNS", "TCP+TLS connect", "First byte", "Body and decode"};
+Samples phaseSamples[PHASE_COUNT];  // us
+Samples heapSamples;                // Minimum free heap of a request (bytes)
+int64_t phaseStart;
+uint32_t requestMinHeap;
+bool requestOpen = false;
+#endif
+#ifdef ENERGY_PROFILE
+const char *STAGE_NAMES[] = {"Wifi connect", "NTP wait", "Token", "Calendar"};
+RTC_DATA_ATTR EnergyDay energyDay;      // Current day
+RTC_DATA_ATTR long lastSleepTime;       // Deep sleep before this wake (s)
+uint32_t stageUs[STAGE_COUNT];          // This wake
+int64_t stageStart, radioStart = -1, radioUs = 0;
+#endif
+long requestStartN, requestEndN; // Window of the calendar request in progress
+TariffPeriod lookahead[2][TARIFF_PERIODS];  // Built in one table while the other is read (no lock)
+volatile int lookaheadActive = 0;
+RTC_DATA_ATTR int fetchRetries;      // Fetches that left published days unknown since the last complete one
+RTC_DATA_ATTR time_t nextFetchTime;  // Backoff of these fetches (UTC)
+
+// Tempo service task : requested days (DayRange, each one pending once) and published colors (TempoDay)
+// The cache mutex also serializes every use of prefs (NVS), by the service task and the LAN handlers
+#ifdef TEMPO_SERVICE_TASK
+SemaphoreHandle_t cacheMutex;
+TaskHandle_t serviceTask;  // Notified for each new pending range
+DayRange pendingRanges[PENDING_RANGES];  // Oldest first (cacheMutex)
+int nPendingRanges;
+QueueHandle_t updateQueue;
+#define LOCK_CACHE() xSemaphoreTakeRecursive(cacheMutex, portMAX_DELAY)
+#define UNLOCK_CACHE() xSemaphoreGiveRecursive(cacheMutex)
+#else
+#define LOCK_CACHE()
+#define UNLOCK_CACHE()
+#endif
+static_assert(WATCHDOG_TIMEOUT*1000UL > SERVICE_PERIOD && WATCHDOG_TIMEOUT*1000UL > WIFI_TIMEOUT + TLS_HANDSHAKE_TIMEOUT*1000 + 2*HTTP_TIMEOUT + BACKOFF_MAX_WAIT, "WATCHDOG_TIMEOUT");
+
+#ifdef DEBUG_HEAP_COUNT
+// Every malloc, calloc and realloc through the linker wrappers (new calls malloc, a String grows with realloc)
+volatile uint32_t heapAllocations = 0;
+extern "C" void *__real_malloc(size_t size);
+extern "C" void *__real_calloc(size_t n, size_t size);
+extern "C" void *__real_realloc(void *ptr, size_t size);
+extern "C" void *__wrap_malloc(size_t size)
+{
+  heapAllocations++;
+  return __real_malloc(size);
+}
+extern "C" void *__wrap_calloc(size_t n, size_t size)
+{
+  heapAllocations++;
+  return __real_calloc(n, size);
+}
+extern "C" void *__wrap_realloc(void *ptr, size_t size)
+{
+  if (size != 0) heapAllocations++;  // realloc(ptr, 0) frees
+  return __real_realloc(ptr, size);
+}
+#endif
+
+/***********************************************************************************
+  Tool functions
+***********************************************************************************/
+
+#ifdef METRICS
+void addSample(Samples *samplesPtr, const uint32_t value)
+{
+  samplesPtr->values[samplesPtr->count++ % METRICS_SAMPLES] = value;
+}
+
+uint32_t getPercentile(const Samples *samplesPtr, const int percent)
+{
+  // Percentile of the last samples (insertion sort of a copy)
+  int n = min(samplesPtr->count, (uint32_t)METRICS_SAMPLES);
+  if (n == 0) return 0;
+  uint32_t sorted[METRICS_SAMPLES];
+  for (int i = 0; i < n; i++)
+  {
+    int j = i;
+    for (; j > 0 && sorted[j-1] > samplesPtr->values[i]; j--) sorted[j] = sorted[j-1];
+    sorted[j] = samplesPtr->values[i];
+  }
+  return sorted[(n-1)*percent/100];
+}
+
+void sampleHeap()
+{
+  requestMinHeap = min(requestMinHeap, (uint32_t)esp_get_free_heap_size());
+}
+
+void startPhase()
+{
+  sampleHeap();
+  phaseStart = esp_timer_get_time();
+}
+
+void endPhase(const Phase phase)
+{
+  addSample(&phaseSamples[phase], esp_timer_get_time() - phaseStart);
+  sampleHeap();
+}
+
+void printMetrics(Print &out)
+{
+  // Count, p50 and p99 of each phase (us), and of the request minimum free heap
+  for (int phase = 0; phase < PHASE_COUNT; phase++)
+  {
+    const Samples *samplesPtr = &phaseSamples[phase];
+    out.printf("%s : n=%u p50=%u us p99=%u us\n", PHASE_NAMES[phase], (unsigned)samplesPtr->count,
+      (unsigned)getPercentile(samplesPtr, 50), (unsigned)getPercentile(samplesPtr, 99));
+  }
+  out.printf("Minimum free heap : n=%u p50=%u p1=%u bytes\n", (unsigned)heapSamples.count,
+    (unsigned)getPercentile(&heapSamples, 50), (unsigned)getPercentile(&heapSamples, 1));
+}
+#else
+inline void startPhase() {}
+inline void endPhase(const Phase phase) {}
+#endif
+
+#ifdef TEMPO_SERVICE_TASK
+void feedWatchdog()
+{
+  // Only the service task is subscribed (long waits of the requests)
+  if (xTaskGetCurrentTaskHandle() == serviceTask) esp_task_wdt_reset();
+}
+#else
+inline void feedWatchdog() {}
+#endif
+
+long dayNumber(const int year, const int month, const int day)
+{
+  // Days since 1970-01-01 (day may be out of the month, e.g. day+1)
+  int y = (month <= 2) ? year-1 : year;
+  int era = (y >= 0 ? y : y-399) / 400;
+  int yoe = y - era*400;
+  int doy = (153*(month > 2 ? month-3 : month+9) + 2)/5 + day-1;
+  int doe = yoe*365 + yoe/4 - yoe/100 + doy;
+  return era*146097L + doe - 719468;
+}
+
+void civilDate(const long n, int *yearPtr, int *monthPtr, int *dayPtr)
+{
+  // Inverse of dayNumber
+  long z = n + 719468;
+  long era = (z >= 0 ? z : z-146096) / 146097;
+  long doe = z - era*146097;
+  long yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+  long doy = doe - (365*yoe + yoe/4 - yoe/100);
+  long mp = (5*doy + 2)/153;
+  *dayPtr = doy - (153*mp + 2)/5 + 1;
+  *monthPtr = (mp < 10) ? mp+3 : mp-9;
+  *yearPtr = yoe + era*400 + (*monthPtr <= 2);
+}
+
+const char *parseZoneName(const char *ptr)
+{
+  // Letters (at least 3), or <...>
+  if (*ptr == '<')
+  {
+    while (*ptr != 0 && *ptr != '>') ptr++;
+    return (*ptr == '>') ? ptr+1 : nullptr;
+  }
+  const char *start = ptr;
+  while (isalpha(*ptr)) ptr++;
+  return (ptr - start >= 3) ? ptr : nullptr;
+}
+
+const char *parseZoneTime(const char *ptr, long *secondsPtr)
+{
+  // [+|-]hh[:mm[:ss]]
+  long sign = 1;
+  if (*ptr == '+' || *ptr == '-') sign = (*ptr++ == '-') ? -1 : 1;
+  if (!isdigit(*ptr)) return nullptr;
+  long seconds = 0;
+  for (long unit = 3600; unit >= 1; unit /= 60)
+  {
+    long value = 0;
+    while (isdigit(*ptr)) value = 10*value + *ptr++ - '0';
+    seconds += value*unit;
+    if (unit == 1 || ptr[0] != ':' || !isdigit(ptr[1])) break;
+    ptr++;
+  }
+  *secondsPtr = sign*seconds;
+  return ptr;
+}
+
+const char *parseZoneRule(const char *ptr, TransitionRule *rulePtr)
+{
+  // ,Mm.w.d[/time] (the Julian day forms are not supported)
+  if (ptr[0] != ',' || ptr[1] != 'M') return nullptr;
+  char *end;
+  rulePtr->month = strtol(ptr+2, &end, 10);
+  if (*end != '.') return nullptr;
+  rulePtr->week = strtol(end+1, &end, 10);
+  if (*end != '.') return nullptr;
+  rulePtr->weekday = strtol(end+1, &end, 10);
+  if (rulePtr->month < 1 || rulePtr->month > 12 || rulePtr->week < 1 || rulePtr->week > 5 || rulePtr->weekday < 0 || rulePtr->weekday > 6) return nullptr;
+  rulePtr->time = 7200;  // 02:00 by default
+  return (*end == '/') ? parseZoneTime(end+1, &rulePtr->time) : end;
+}
+
+bool parseTimeZone(const char *text, TimeZone *zonePtr)
+{
+  // std offset [dst [offset],start[/time],end[/time]], e.g. "CET-1CEST,M3.5.0,M10.5.0/3" (POSIX offsets are west of UTC)
+  *zonePtr = {0};
+  long offset;
+  const char *ptr = parseZoneName(text);
+  if (ptr == nullptr || (ptr = parseZoneTime(ptr, &offset)) == nullptr) return false;
+  zonePtr->stdOffset = zonePtr->dstOffset = -offset;
+  if (*ptr == 0) return true;  // No DST
+  if ((ptr = parseZoneName(ptr)) == nullptr) return false;
+  zonePtr->dstOffset = zonePtr->stdOffset + 3600;
+  if (*ptr != ',')
+  {
+    if ((ptr = parseZoneTime(ptr, &offset)) == nullptr) return false;
+    zonePtr->dstOffset = -offset;
+  }
+  if ((ptr = parseZoneRule(ptr, &zonePtr->dstStart)) == nullptr || (ptr = parseZoneRule(ptr, &zonePtr->dstEnd)) == nullptr || *ptr != 0)
+  {
+    zonePtr->dstOffset = zonePtr->stdOffset;
+    return false;
+  }
+  zonePtr->hasDST = true;
+  return true;
+}
+
+time_t transitionUTC(const int year, const TransitionRule *rulePtr, const long offset)
+{
+  // UTC instant of a change, at a local time of the offset before it
+  long first = dayNumber(year, rulePtr->month, 1);
+  long next = (rulePtr->month == 12) ? dayNumber(year+1, 1, 1) : dayNumber(year, rulePtr->month+1, 1);
+  long n = first + (rulePtr->weekday - (first+4)%7 + 7)%7 + 7*(rulePtr->week-1);  // 1970-01-01 was a Thursday
+  if (n >= next) n -= 7;  // Last week
+  return n*86400L + rulePtr->time - offset;
+}
+
+void setZoneYear(const int year)
+{
+  // Changes of a year, computed once
+  if (zone.year == year) return;
+  zone.yearStart = dayNumber(year, 1, 1)*86400L - zone.stdOffset;
+  zone.yearEnd = dayNumber(year+1, 1, 1)*86400L - zone.stdOffset;
+  zone.dstStartUTC = transitionUTC(year, &zone.dstStart, zone.stdOffset);
+  zone.dstEndUTC = transitionUTC(year, &zone.dstEnd, zone.dstOffset);
+  zone.year = year;
+}
+
+long utcOffset(const time_t t)
+{
+  // Offset (s) of the local time at UTC instant t
+  if (!zone.hasDST) return zone.stdOffset;
+  if (t < zone.yearStart || t >= zone.yearEnd)
+  {
+    int year, month, day;
+    civilDate((t + zone.stdOffset) / 86400, &year, &month, &day);
+    setZoneYear(year);
+  }
+  bool dst = (zone.dstStartUTC < zone.dstEndUTC) ?
+    (t >= zone.dstStartUTC && t < zone.dstEndUTC) :  // Northern hemisphere
+    (t >= zone.dstStartUTC || t < zone.dstEndUTC);
+  return dst ? zone.dstOffset : zone.stdOffset;
+}
+
+time_t localToUTC(const long n, const long second, LocalTimeKind *kindPtr = nullptr)
+{
+  // UTC instant of a local time (second of day n, may be out of the day) :
+  // the first one if it is ambiguous (DST end), shifted by the gap if it is nonexistent (DST start, as mktime)
+  time_t local = n*86400L + second;
+  time_t stdUTC = local - zone.stdOffset, dstUTC = local - zone.dstOffset;
+  bool stdValid = (utcOffset(stdUTC) == zone.stdOffset), dstValid = (utcOffset(dstUTC) == zone.dstOffset);
+  LocalTimeKind kind = LocalTimeKind::UNIQUE;
+  time_t t = stdValid ? stdUTC : dstUTC;
+  if (stdValid && dstValid && stdUTC != dstUTC)
+  {
+    kind = LocalTimeKind::AMBIGUOUS;
+    t = min(stdUTC, dstUTC);
+  }
+  else if (!stdValid && !dstValid)
+  {
+    kind = LocalTimeKind::NONEXISTENT;
+    t = local - utcOffset(min(stdUTC, dstUTC));  // Offset before the change
+  }
+  if (kindPtr != nullptr) *kindPtr = kind;
+  return t;
+}
+
+void toLocalTime(const time_t t, tm *timePtr)
+{
+  // Local time at UTC instant t (localtime_r without newlib)
+  long offset = utcOffset(t);
+  time_t local = t + offset;
+  long n = local / 86400, second = local % 86400;
+  int year, month, day;
+  civilDate(n, &year, &month, &day);
+  *timePtr = {0};
+  timePtr->tm_year = year-1900;
+  timePtr->tm_mon = month-1;
+  timePtr->tm_mday = day;
+  timePtr->tm_hour = second / 3600;
+  timePtr->tm_min = second / 60 % 60;
+  timePtr->tm_sec = second % 60;
+  timePtr->tm_wday = (n+4) % 7;
+  timePtr->tm_yday = n - dayNumber(year, 1, 1);
+  timePtr->tm_isdst = (zone.hasDST && offset != zone.stdOffset);
+}
+
+void setTimeZone(const char *timeZone)
+{
+  // To work with Local time (RTC) : newlib, and the time zone table
+  setenv("TZ", timeZone, 1); 
+  tzset();
+  if (!parseTimeZone(timeZone, &zone)) Serial.println("Error : unsupported time zone, DST ignored");
+}
+
+bool isClockSet()
+{
+  // RTC clock initialized (by NTP or before a deep sleep)
+  return time(nullptr) > 1700000000;  // After 2023
+}
+
+void onTimeSync(struct timeval *tv)
+{
+  // SNTP notification (lwIP task)
+  lastTimeSync = tv->tv_sec;
+  timeSynced = true;
+}
+
+long getClockDrift()
+{
+  // Estimated error (s) of the RTC clock since the last NTP synchronization
+  return (long)((long long)(time(nullptr) - lastTimeSync) * RTC_DRIFT_PPM / 1000000);
+}
+
+bool needsTimeSync()
+{
+  // RTC not set, drift budget exceeded, or day boundary within the drift (the current day may be wrong)
+  if (!isClockSet() || lastTimeSync == 0) return true;
+  long drift = getClockDrift();
+  if (drift >= DRIFT_BUDGET) return true;
+  tm now;
+  toLocalTime(time(nullptr), &now);
+  long second = now.tm_hour*3600L + now.tm_min*60 + now.tm_sec;
+  return second <= drift || 86400 - second <= drift;
+}
+
+void startTimeSync(const char *timeZone)
+{
+  // Set RTC with Local time, using an NTP server only if needed : SNTP runs in the background (lwIP)
+  setTimeZone(timeZone);
+  if (!needsTimeSync()) return;
+  timeSynced = false;
+  sntp_set_time_sync_notification_cb(onTimeSync);
+  configTzTime(timeZone, NTP_SERVER);
+  timeSyncStarted = true;
+}
+
+bool waitTimeSync(const unsigned long timeout)
+{
+  // Wait (only when the current time is required) for the NTP synchronization, if any
+  unsigned long start = millis();
+  while (timeSyncStarted && !timeSynced && millis() - start < timeout) delay(10);
+  return isClockSet();  // Possibly the RTC clock within its drift, if the NTP server does not answer
+}
+
+bool waitWifi(const unsigned long timeout)
+{
+  // Wait for the connection, yielding to other tasks
+  unsigned long start = millis();
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    if (millis() - start > timeout) return false;
+    feedWatchdog();
+    delay(10);
+  }
+  return true;
+}
+
+bool connectWifi(const unsigned long timeout)
+{
+  // Fast reconnect with the last access point and channel (no scan), else a full connection
+  WiFi.persistent(false);
+  WiFi.mode(WIFI_STA);
+  if (wifiCache.valid)
+  {
+#ifdef WIFI_STATIC_IP
+    WiFi.config(IPAddress(wifiCache.ip), IPAddress(wifiCache.gateway), IPAddress(wifiCache.subnet), IPAddress(wifiCache.dns));
+#endif
+    WiFi.begin(SSID, PWD, wifiCache.channel, wifiCache.bssid);
+    if (waitWifi(timeout/2)) return true;
+    wifiCache.valid = false;  // Access point changed
+    WiFi.disconnect();
+#ifdef WIFI_STATIC_IP
+    WiFi.config(IPAddress(), IPAddress(), IPAddress());  // DHCP
+#endif
+  }
+  WiFi.begin(SSID, PWD);
+  if (!waitWifi(timeout)) return false;
+
+  // Save the connection
+  memcpy(wifiCache.bssid, WiFi.BSSID(), sizeof(wifiCache.bssid));
+  wifiCache.channel = WiFi.channel();
+  wifiCache.ip = WiFi.localIP();
+  wifiCache.gateway = WiFi.gatewayIP();
+  wifiCache.subnet = WiFi.subnetMask();
+  wifiCache.dns = WiFi.dnsIP();
+  wifiCache.valid = true;
+  return true;
+}
+
+void saveSeason()
+{
+  // Save new colors in NVS
+  LOCK_CACHE();
+  if (seasonCache.dirty)
+  {
+    char key[8];
+    sprintf(key, "s%d", seasonCache.season);
+    prefs.begin("tempo", false);
+    prefs.putBytes(key, seasonCache.colors, sizeof(seasonCache.colors));
+    prefs.end();
+    seasonCache.dirty = false;
+  }
+  UNLOCK_CACHE();
+}
+
+void loadSeason(const int season)
+{
+  // Season cache in RAM, from NVS (empty if never saved)
+  if (seasonCache.season == season) return;
+  LOCK_CACHE();
+  saveSeason();
+  char key[8];
+  sprintf(key, "s%d", season);
+  prefs.begin("tempo", true);
+  if (prefs.getBytes(key, seasonCache.colors, sizeof(seasonCache.colors)) != sizeof(seasonCache.colors)) memset(seasonCache.colors, 0, sizeof(seasonCache.colors));
+  prefs.end();
+  seasonCache.season = season;
+  seasonCache.dirty = false;
+  UNLOCK_CACHE();
+}
+
+int seasonOf(const long n)
+{
+  // Year of the 1st of September starting the season of day n
+  int year, month, day;
+  civilDate(n, &year, &month, &day);
+  return (month >= 9) ? year : year-1;
+}
+
+int seasonDay(const long n)
+{
+  // Load the season of day n, and return the index of the day in the season
+  int season = seasonOf(n);
+  loadSeason(season);
+  return n - dayNumber(season, 9, 1);
+}
+
+TempoColor getCachedColor(const long n)
+{
+  // Color of day n (UNDEFINED if unknown)
+  LOCK_CACHE();
+  int i = seasonDay(n);
+  TempoColor color = (TempoColor)((seasonCache.colors[i/4] >> 2*(i%4)) & 3);
+  UNLOCK_CACHE();
+  return color;
+}
+
+TempoColor peekCachedColor(const long n, SeasonView *viewPtr)
+{
+  // Color of day n without changing the loaded season (the working season of the service task) :
+  // another season is read from NVS in the view, once per view
+  int season = seasonOf(n);
+  int i = n - dayNumber(season, 9, 1);
+  LOCK_CACHE();
+  const uint8_t *colors = seasonCache.colors;
+  if (seasonCache.season != season)
+  {
+    if (viewPtr->season != season)
+    {
+      char key[8];
+      sprintf(key, "s%d", season);
+      prefs.begin("tempo", true);
+      if (prefs.getBytes(key, viewPtr->colors, sizeof(viewPtr->colors)) != sizeof(viewPtr->colors)) memset(viewPtr->colors, 0, sizeof(viewPtr->colors));
+      prefs.end();
+      viewPtr->season = season;
+    }
+    colors = viewPtr->colors;
+  }
+  TempoColor color = (TempoColor)((colors[i/4] >> 2*(i%4)) & 3);
+  UNLOCK_CACHE();
+  return color;
+}
+
+void setCachedColor(const long n, const TempoColor color)
+{
+  // Published colors are final
+  LOCK_CACHE();
+  int i = seasonDay(n);
+  int code = (int)color;
+  if (((seasonCache.colors[i/4] >> 2*(i%4)) & 3) != code)
+  {
+    seasonCache.colors[i/4] = (seasonCache.colors[i/4] & ~(3 << 2*(i%4))) | (code << 2*(i%4));
+    seasonCache.dirty = true;
+  }
+  UNLOCK_CACHE();
+}
+
+const char *colorName(const TempoColor color)
+{
+  return COLOR_NAMES[(int)color];
+}
+
+void initSession()
+{
+  // All the requests go to the same host : keep the TLS connection open (HTTP/1.1 keep-alive)
+#ifdef PINNED_ROOT_CA
+  client.setCACert(RTE_ROOT_CA);  // Only the RTE chain, without the default CA bundle
+#else
+  client.setInsecure();
+#endif
+  client.setHandshakeTimeout(TLS_HANDSHAKE_TIMEOUT);
+  http.setReuse(true);
+  requestURL.reserve(CONFIG.urlSize);
+  requestAuthorization.reserve(CONFIG.authorizationSize);
+}
+
+bool beginRequest(const char *url, const char *scheme, const char *credentials)
+{
+  // URL and Authorization value copied in reserved Strings, constant header names : no temporary built here,
+  // but not allocation free (HTTPClient copies the URL in begin, appends the headers, and collectHeaders allocates)
+  if (strlen(scheme) + 1 + strlen(credentials) >= CONFIG.authorizationSize) return false;
+  requestURL = url;  // Copies in the reserved capacity
+  requestAuthorization = scheme;
+  requestAuthorization += " ";
+  requestAuthorization += credentials;
+#ifdef DEBUG_PRINT
+  Serial.printf("URL : %s\nAuthorization : %s\n", url, requestAuthorization.c_str());
+#endif
+
+#ifdef METRICS
+  requestMinHeap = UINT32_MAX;
+  requestOpen = true;
+#endif
+
+  // Reuse the connection, or reconnect if the server has closed it (DNS, then TCP and TLS)
+  if (!client.connected())
+  {
+    client.stop();
+    IPAddress ip;
+    startPhase();
+    bool okDNS = WiFi.hostByName(RTE_HOST, ip);
+    endPhase(PHASE_DNS);
+    if (!okDNS) return false;
+    startPhase();
+    bool okConnect = client.connect(RTE_HOST, 443);  // Resolved name in the lwIP DNS cache
+    endPhase(PHASE_CONNECT);
+    if (!okConnect) return false;
+  }
+  if (!http.begin(client, requestURL)) return false;
+  http.setTimeout(HTTP_TIMEOUT);
+  static const char *HEADERS[] = {"Retry-After", "ETag", "Last-Modified", "Transfer-Encoding"};
+  http.collectHeaders(HEADERS, 4);  // Per request : values of a previous response not kept
+  http.addHeader(AUTHORIZATION_HEADER, requestAuthorization);
+  http.addHeader(ACCEPT_HEADER, JSON_TYPE);
+  return true;
+}
+
+HttpBodyStream responseBody(HTTPClient &httpClient, const int code)
+{
+  // Body of the response to a GET : none (204, 304), chunked (collected Transfer-Encoding header), or its size if known
+  bool chunked = strcasestr(httpClient.header("Transfer-Encoding").c_str(), "chunked") != nullptr;
+  return HttpBodyStream(httpClient.getStreamPtr(), (code == 204 || code == 304) ? 0 : httpClient.getSize(), chunked);
+}
+
+void endRequest()
+{
+  // The connection is kept open, unless the server asked to close it
+#ifdef METRICS
+  if (requestOpen)
+  {
+    endPhase(PHASE_BODY);
+    addSample(&heapSamples, requestMinHeap);
+    requestOpen = false;
+  }
+#endif
+  http.end();
+}
+
+void saveToken()
+{
+  LOCK_CACHE();
+  prefs.begin("tempo", false);
+  prefs.putBytes("token", &tokenCache, sizeof(tokenCache));
+  prefs.end();
+  UNLOCK_CACHE();
+}
+
+void invalidateToken()
+{
+  // Token rejected by the API (401), also in NVS
+  tokenCache = {0};
+  saveToken();
+}
+
+bool getToken(const char **tokenPtr);
+
+bool takeRequestBudget()
+{
+  // Global request budget per hour (the hour counts from boot while the RTC is not set)
+  long hour = isClockSet() ? time(nullptr)/3600 : -1;
+  if (hour != budgetHour)
+  {
+    budgetHour = hour;
+    budgetCount = 0;
+  }
+  if (budgetCount >= REQUEST_BUDGET) return false;
+  budgetCount++;
+  return true;
+}
+
+int executeGet(const char *url, const bool bearer, void (*addHeaders)())
+{
+  // GET request with retries, left open for the decoding (then endRequest)
+  unsigned long backoff = BACKOFF_FIRST;
+  int code = -1;  // HTTPC_ERROR_CONNECTION_REFUSED
+  for (int attempt = 0; attempt < MAX_ATTEMPTS; attempt++)
+  {
+    feedWatchdog();  // Each attempt and wait are bounded
+    if (!takeRequestBudget()) return HTTP_BUDGET_EXCEEDED;
+    const char *credentials = AUTH;
+    if (bearer && !getToken(&credentials)) return code;
+    if (beginRequest(url, bearer ? "Bearer" : "Basic", credentials))
+    {
+      if (addHeaders != nullptr) addHeaders();
+      startPhase();
+      code = http.GET();
+      endPhase(PHASE_FIRST_BYTE);
+      startPhase();  // Body
+      if (code > 0 && code != 200) responseBody(http, code).drain();  // Error body : the kept connection starts with the next response
+    }
+    else code = -1;  // HTTPC_ERROR_CONNECTION_REFUSED
+
+    // Wait before the next attempt
+    unsigned long wait;
+    if (code == 401 && bearer)
+    {
+      invalidateToken();  // New token, at once
+      wait = 0;
+    }
+    else if (code == 429)
+    {
+      long retryAfter = http.header("Retry-After").toInt();  // Seconds (an HTTP date gives 0)
+      wait = (retryAfter > 0) ? retryAfter*1000 : backoff;
+      backoff *= 2;
+    }
+    else if (code < 0 || code >= 500)
+    {
+      wait = backoff/2 + esp_random()%(backoff/2 + 1);  // Jitter : devices out of lockstep
+      backoff *= 2;
+    }
+    else return code;  // Success or final error
+    if (attempt == MAX_ATTEMPTS-1 || wait > BACKOFF_MAX_WAIT) break;
+    endRequest();
+    retryCount++;
+#ifdef DEBUG_PRINT
+    Serial.printf("HTTP code %d : retry in %lu ms\n", code, wait);
+#endif
+    delay(wait);
+  }
+  return code;
+}
+
+bool getAccessToken(char *token, const size_t size, long *expiresInPtr)
+{
+  // Local variables
+  bool okToken = false;
+  const char *url = "https://digital.iservices.rte-france.com/token/oauth/";
+
+  // HTTP Get request, decode only the useful fields, directly from the connection
+  if (executeGet(url, false, nullptr) == 200) 
+  {
+    static JsonDocument filter;
+    if (filter.isNull())
+    {
+      filter["access_token"] = true;
+      filter["expires_in"] = true;
+    }
+    HttpBodyStream body = responseBody(http, 200);
+    if (!deserializeJson(doc, body, DeserializationOption::Filter(filter)))
+    {
+      const char* accessToken = doc["access_token"] | "";
+      long expiresIn = doc["expires_in"] | 0L;
+#ifdef DEBUG_PRINT
+      DEBUG_SINK.println("Payload :");
+      serializeJsonPretty(doc, DEBUG_SINK);
+      DEBUG_SINK.printf("\nToken : %s\nExpires in : %ld s\n", accessToken, expiresIn);
+#endif
+      *expiresInPtr = expiresIn;
+      okToken = (accessToken[0] != 0) && (strlcpy(token, accessToken, size) < size);
+    }
+    body.drain();
+  }
+  endRequest();
+  return okToken;
+}
+
+bool updateTokenExpiry()
+{
+  // Expiry of a token obtained while the RTC was not set yet (boot with NTP and token in parallel)
+  if (tokenExpiresIn <= 0 || !isClockSet()) return false;
+  tokenCache.expiry = time(nullptr) - (millis() - tokenMillis)/1000 + tokenExpiresIn;
+  tokenExpiresIn = 0;
+  saveToken();
+  return true;
+}
+
+bool getToken(const char **tokenPtr)
+{
+  // Cached access token, refreshed only if it is close to expiring
+  if (tokenCache.token[0] == 0)
+  {
+    // Cold boot : RTC memory lost, try NVS
+    LOCK_CACHE();
+    prefs.begin("tempo", true);
+    if (prefs.getBytes("token", &tokenCache, sizeof(tokenCache)) != sizeof(tokenCache)) tokenCache = {0};
+    prefs.end();
+    UNLOCK_CACHE();
+  }
+  updateTokenExpiry();
+  bool expired = (tokenCache.expiry != 0) && isClockSet() && (time(nullptr) > tokenCache.expiry - TOKEN_MARGIN);
+  if (tokenCache.token[0] == 0 || expired)
+  {
+    long expiresIn;
+    if (!getAccessToken(tokenCache.token, sizeof(tokenCache.token), &expiresIn))
+    {
+      tokenCache.token[0] = 0;
+      return false;
+    }
+    tokenCache.expiry = 0;  // Unknown expiry => refresh on 401
+    tokenExpiresIn = expiresIn;
+    tokenMillis = millis();
+    if (!updateTokenExpiry()) saveToken();
+  }
+  *tokenPtr = tokenCache.token;
+  return true;
+}
+
+int midnightOffset(const long n)
+{
+  // UTC offset (minutes) at 00:00 local time of day n (TIME_ZONE)
+  return (n*86400L - localToUTC(n, 0)) / 60;
+}
+
+char *formatDate(char *buf, const long n)
+{
+  // ISO 8601 local midnight of day n : YYYY-MM-DDT00:00:00+hh:mm or -hh:mm (25 characters)
+  int year, month, day;
+  civilDate(n, &year, &month, &day);
+  int offset = midnightOffset(n);
+  char sign = (offset < 0) ? '-' : '+';
+  offset = abs(offset);
+  sprintf(buf, "%04d-%02d-%02dT00:00:00%c%02d:%02d", year, month, day, sign, offset/60, offset%60);
+  return buf+25;
+}
+
+const char *setCalendarURL(const long startN, const long endN)
+{
+  // Calendar URL for the days in [startN, endN[, in a fixed buffer
+  static char url[CALENDAR_URL_SIZE];
+  char *ptr = url + sizeof(CALENDAR_BASE_URL)-1;
+  if (*ptr == 0) memcpy(url, CALENDAR_BASE_URL, sizeof(CALENDAR_BASE_URL)-1);  // First call
+  ptr = formatDate(ptr, startN);
+  memcpy(ptr, "&end_date=", 10);
+  formatDate(ptr+10, endN);
+  return url;
+}
+
+int peekNonSpace(Stream &stream)
+{
+  // Next significant JSON character
+  while (isspace(stream.peek())) stream.read();
+  return stream.peek();
+}
+
+#ifdef DELTA_DECODE
+bool scanString(Stream &body, char *buf, const size_t size)
+{
+  // Rest of a JSON string (after the opening quote), truncated in buf if any (escaped characters kept as '?')
+  size_t length = 0;
+  while (true)
+  {
+    int c = body.read();
+    if (c < 0) return false;
+    if (c == '"') break;
+    if (c == '\\')
+    {
+      if (body.read() < 0) return false;
+      c = '?';
+    }
+    if (length+1 < size) buf[length++] = c;
+  }
+  if (size > 0) buf[length] = 0;
+  return true;
+}
+
+bool skipValue(Stream &body)
+{
+  // Any JSON value (string, number, literal, object or array), up to the next separator
+  int depth = 0;
+  while (true)
+  {
+    int c = peekNonSpace(body);
+    if (c < 0) return false;
+    if (depth == 0 && (c == ',' || c == '}' || c == ']')) return true;
+    body.read();
+    if (c == '"' && !scanString(body, nullptr, 0)) return false;
+    if (c == '{' || c == '[') depth++;
+    if ((c == '}' || c == ']') && --depth == 0) return true;
+  }
+}
+
+bool scanCalendarValue(Stream &body, char date[11], char value[8])
+{
+  // One values[] object : day (YYYY-MM-DD) and color strings, the other members skipped
+  date[0] = value[0] = 0;
+  if (peekNonSpace(body) != '{') return false;
+  body.read();
+  if (peekNonSpace(body) == '}') return body.read() == '}';
+  while (true)
+  {
+    char key[16];
+    if (peekNonSpace(body) != '"') return false;
+    body.read();
+    if (!scanString(body, key, sizeof(key)) || peekNonSpace(body) != ':') return false;
+    body.read();
+    bool isDate = !strcmp(key, "start_date") || !strcmp(key, "date");
+    bool isValue = !strcmp(key, "value") || !strcmp(key, "color");
+    if ((isDate || isValue) && peekNonSpace(body) == '"')
+    {
+      body.read();
+      if (!scanString(body, isDate ? date : value, isDate ? 11 : 8)) return false;
+    }
+    else if (!skipValue(body)) return false;
+    int c = peekNonSpace(body);
+    body.read();
+    if (c == '}') return true;
+    if (c != ',') return false;
+  }
+}
+
+bool decodeCalendar(Stream &body, int *changesPtr = nullptr)
+{
+  // Colors of a calendar response saved in the cache, by a scanner without any document (O(changes) cache writes) :
+  // RTE elements {"start_date":..., "value":...}, or peer elements {"date":..., "color":...} (LAN server)
+  // The days already known with the same color are skipped, only the new or changed ones are written
+  int changes = 0;
+  if (changesPtr != nullptr) *changesPtr = 0;
+  if (!body.find("\"values\"") || !body.find("[")) return false;
+  if (peekNonSpace(body) == ']') return true;
+  do
+  {
+    char date[11], value[8];
+    if (!scanCalendarValue(body, date, value)) return false;
+    TempoColor color = parseTempoColor(value);
+    int year, month, day;
+    if (color == TempoColor::UNDEFINED || sscanf(date, "%d-%d-%d", &year, &month, &day) != 3) continue;
+    long n = dayNumber(year, month, day);
+    if (getCachedColor(n) == color) continue;
+    setCachedColor(n, color);
+    changes++;
+#ifdef DEBUG_PRINT
+    DEBUG_SINK.printf("Delta : %s %s\n", date, value);
+#endif
+  }
+  while (peekNonSpace(body) == ',' && body.read() == ',');
+  if (changesPtr != nullptr) *changesPtr = changes;
+  return peekNonSpace(body) == ']';
+}
+#else
+bool decodeCalendar(Stream &body, int *changesPtr = nullptr)
+{
+  // Colors of a calendar response saved in the cache (values array streamed one element at a time : memory does not depend on the number of days)
+  // RTE elements {"start_date":..., "value":...}, or peer elements {"date":..., "color":...} (LAN server)
+  static JsonDocument filter;
+  if (filter.isNull())
+  {
+    filter["start_date"] = true;
+    filter["value"] = true;
+    filter["date"] = true;
+    filter["color"] = true;
+  }
+  if (changesPtr != nullptr) *changesPtr = 0;
+  if (!body.find("\"values\"") || !body.find("[")) return false;
+  if (peekNonSpace(body) == ']') return true;
+  do
+  {
+    if (deserializeJson(doc, body, DeserializationOption::Filter(filter))) return false;
+#ifdef DEBUG_PRINT
+    DEBUG_SINK.println("Value :");
+    serializeJsonPretty(doc, DEBUG_SINK);
+    DEBUG_SINK.println();
+#endif
+    const char* date = doc["start_date"] | doc["date"].as<const char*>();
+    TempoColor color = parseTempoColor(doc["value"] | doc["color"].as<const char*>());
+    int year, month, day;
+    if (date == nullptr || sscanf(date, "%d-%d-%d", &year, &month, &day) != 3 || color == TempoColor::UNDEFINED) continue;
+    long n = dayNumber(year, month, day);
+    if (changesPtr != nullptr && getCachedColor(n) != color) (*changesPtr)++;
+    setCachedColor(n, color);
+  }
+  while (body.findUntil(",", "]"));
+  return true;
+}
+#endif
+
+void getCachedRange(const long startN, const long endN, TempoDay *daysPtr, const int maxDays, int *nDaysPtr)
+{
+  // Known colors of the days in [startN, endN[, most recent first
+  *nDaysPtr = 0;
+  for (long n = endN-1; n >= startN && *nDaysPtr < maxDays; n--)
+  {
+    TempoColor color = getCachedColor(n);
+    if (color == TempoColor::UNDEFINED) continue;
+    int year, month, day;
+    civilDate(n, &year, &month, &day);
+    TempoDay *dayPtr = daysPtr + *nDaysPtr;
+    sprintf(dayPtr->date, "%04d-%02d-%02d", year, month, day);
+    dayPtr->color = color;
+    (*nDaysPtr)++;
+  }
+}
+
+#ifdef CONDITIONAL_FETCH
+void setConditionalHeaders()
+{
+  // Validators of the last response for the same window
+  if (conditionalCache.startN != requestStartN || conditionalCache.endN != requestEndN) return;
+  if (conditionalCache.etag[0] != 0) http.addHeader("If-None-Match", conditionalCache.etag);
+  if (conditionalCache.lastModified[0] != 0) http.addHeader("If-Modified-Since", conditionalCache.lastModified);
+}
+
+void saveConditionalHeaders()
+{
+  conditionalCache.startN = requestStartN;
+  conditionalCache.endN = requestEndN;
+  strlcpy(conditionalCache.etag, http.header("ETag").c_str(), sizeof(conditionalCache.etag));
+  strlcpy(conditionalCache.lastModified, http.header("Last-Modified").c_str(), sizeof(conditionalCache.lastModified));
+}
+#endif
+
+#ifdef FLEET_MODE
+uint32_t rendezvousScore(const char *peer)
+{
+  // FNV-1a of the site and the peer, then mixed (MurmurHash3 finalizer)
+  uint32_t h = 2166136261u;
+  for (const char *ptr = FLEET_SITE; *ptr != 0; ptr++) h = (h ^ (uint8_t)*ptr) * 16777619u;
+  for (const char *ptr = peer; *ptr != 0; ptr++) h = (h ^ (uint8_t)*ptr) * 16777619u;
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+const int *rankPeers()
+{
+  // Peers by decreasing score, computed once (same order on every node)
+  static int order[N_PEERS];
+  static bool ranked = false;
+  if (ranked) return order;
+  for (int i = 0; i < N_PEERS; i++)
+  {
+    int j = i;
+    for (; j > 0 && rendezvousScore(FLEET_PEERS[order[j-1]]) < rendezvousScore(FLEET_PEERS[i]); j--) order[j] = order[j-1];
+    order[j] = i;
+  }
+  ranked = true;
+  return order;
+}
+
+PeerAnswer fetchFromPeer(const IPAddress &ip, const long startN, const long endN)
+{
+  // GET /tempo/range of a peer, colors saved in the cache (PEER_NONE if it cannot answer)
+  int startYear, startMonth, startDay, endYear, endMonth, endDay;
+  civilDate(startN, &startYear, &startMonth, &startDay);
+  civilDate(endN, &endYear, &endMonth, &endDay);
+  char url[96];
+  snprintf(url, sizeof(url), "http://%u.%u.%u.%u:%d/tempo/range?start=%04d-%02d-%02d&end=%04d-%02d-%02d&fetch=1",
+    ip[0], ip[1], ip[2], ip[3], LAN_SERVER_PORT, startYear, startMonth, startDay, endYear, endMonth, endDay);
+#ifdef DEBUG_PRINT
+  Serial.printf("Peer URL : %s\n", url);
+#endif
+  peerHttp.setConnectTimeout(PEER_TIMEOUT);
+  if (!peerHttp.begin(peerClient, url)) return PEER_NONE;
+  peerHttp.setTimeout(PEER_TIMEOUT);
+  static const char *HEADERS[] = {"Transfer-Encoding"};
+  peerHttp.collectHeaders(HEADERS, 1);
+  PeerAnswer answer = PEER_NONE;
+  int code = peerHttp.GET();
+  if (code == 200)
+  {
+    HttpBodyStream body = responseBody(peerHttp, code);
+    if (decodeCalendar(body)) answer = PEER_DONE;
+    body.drain();
+    saveSeason();
+  }
+  else if (code > 0)
+  {
+    responseBody(peerHttp, code).drain();  // Kept connection
+    if (code == 503) answer = PEER_PENDING;
+  }
+  peerHttp.end();
+  return answer;
+}
+
+PeerAnswer fetchFromPeers(const long startN, const long endN)
+{
+  // Colors of [startN, endN[ from the first reachable peer ranked above this node, PEER_NONE if this node is the leader
+  // (a peer that answers has all the published days : its unknown days are not published yet)
+  const int *order = rankPeers();
+  IPAddress self = WiFi.localIP();
+  for (int i = 0; i < N_PEERS; i++)
+  {
+    int peer = order[i];
+    IPAddress ip;
+    if (!ip.fromString(FLEET_PEERS[peer])) continue;
+    if (ip == self) return PEER_NONE;
+    if (peerDownMillis[peer] != 0 && millis() - peerDownMillis[peer] < PEER_RETRY) continue;
+    PeerAnswer answer = fetchFromPeer(ip, startN, endN);
+    if (answer != PEER_NONE)
+    {
+      peerDownMillis[peer] = 0;
+      return answer;
+    }
+    peerDownMillis[peer] = max(millis(), 1UL);
+  }
+  return PEER_NONE;  // Not in the peer list, or no peer above this node reachable
+}
+#endif
+
+bool getTempoColorRange(const int startYear, const int startMonth, const int startDay, const int endYear, const int endMonth, const int endDay, TempoDay *daysPtr, const int maxDays, int *nDaysPtr)
+{
+  // Tempo colors of the days in [start date, end date[, in the order sent by RTE (most recent first)
+  // Cache first : request only for the window of the unknown days
+  long startN = dayNumber(startYear, startMonth, startDay);
+  long endN = dayNumber(endYear, endMonth, endDay);
+  long planStartN = startN, planEndN = endN;
+  while (planStartN < planEndN && getCachedColor(planStartN) != TempoColor::UNDEFINED) planStartN++;
+  while (planEndN > planStartN && getCachedColor(planEndN-1) != TempoColor::UNDEFINED) planEndN--;
+  if (planStartN == planEndN)
+  {
+    cacheHits++;
+    getCachedRange(startN, endN, daysPtr, maxDays, nDaysPtr);
+    return true;
+  }
+  cacheMisses++;
+
+#ifdef FLEET_MODE
+  // Peer first, RTE only for the leader (a pending peer is asked again later)
+  PeerAnswer answer = fetchFromPeers(planStartN, planEndN);
+  if (answer != PEER_NONE)
+  {
+    if (answer == PEER_DONE) lastFetch = time(nullptr);
+    getCachedRange(startN, endN, daysPtr, maxDays, nDaysPtr);
+    return answer == PEER_DONE;
+  }
+#endif
+
+  // Local variables
+  bool okColors = false;
+  const char *url = setCalendarURL(planStartN, planEndN);
+  *nDaysPtr = 0;
+
+  // HTTP Get request, with retries
+#ifdef DEBUG_HEAP_COUNT
+  uint32_t allocations = heapAllocations;
+#endif
+  requestStartN = planStartN;
+  requestEndN = planEndN;
+#ifdef CONDITIONAL_FETCH
+  int code = executeGet(url, true, setConditionalHeaders);
+#else
+  int code = executeGet(url, true, nullptr);
+#endif
+
+  // Decode response
+  if (code == 200) 
+  {
+    HttpBodyStream body = responseBody(http, code);
+    okColors = decodeCalendar(body);
+    body.drain();
+    saveSeason();
+#ifdef CONDITIONAL_FETCH
+    if (okColors) saveConditionalHeaders();
+#endif
+  }
+  else if (code == 400 || code == 304)
+  {
+    // No published color in the window, or not modified since the last response
+    okColors = true;
+  }
+  endRequest();
+  if (okColors) lastFetch = time(nullptr);
+  else fetchErrors++;
+
+  // Colors of all the window (known before or just received)
+  getCachedRange(startN, endN, daysPtr, maxDays, nDaysPtr);
+#ifdef DEBUG_HEAP_COUNT
+  Serial.printf("Heap allocations : %u\n", (unsigned)(heapAllocations - allocations));
+#endif
+  return okColors;
+}
+
+bool getTempoDayColor(const int year, const int month, const int day, TempoColor *colorPtr)
+{
+  // One day range
+  TempoDay tempoDay;
+  int nDays;
+  if (!getTempoColorRange(year, month, day, year, month, day+1, &tempoDay, 1, &nDays)) return false;
+  *colorPtr = (nDays == 1) ? tempoDay.color : TempoColor::UNDEFINED;
+  return true;
+}
+
+#ifdef ENERGY_PROFILE
+void startStage()
+{
+  stageStart = esp_timer_get_time();
+}
+
+void endStage(const Stage stage)
+{
+  stageUs[stage] += esp_timer_get_time() - stageStart;
+}
+
+void radioOn()
+{
+  if (radioStart < 0) radioStart = esp_timer_get_time();
+}
+
+void radioOff()
+{
+  if (radioStart >= 0) radioUs += esp_timer_get_time() - radioStart;
+  radioStart = -1;
+}
+
+float getCharge(const uint64_t radio, const uint64_t active, const uint64_t sleep)
+{
+  // mAh, the radio times being CPU active times too
+  return (CURRENT_RADIO*radio + CURRENT_ACTIVE*(active - radio) + CURRENT_SLEEP*sleep) / 3.6e9f;
+}
+
+void printEnergyDay(Print &out, const EnergyDay *dayPtr)
+{
+  int year, month, day;
+  civilDate(dayPtr->day, &year, &month, &day);
+  out.printf("%04d-%02d-%02d : %u wakes, active %llu ms, radio %llu ms, sleep %llu s, %.3f mAh\n", year, month, day,
+    (unsigned)dayPtr->wakes, dayPtr->activeUs/1000, dayPtr->radioUs/1000, dayPtr->sleepUs/1000000, dayPtr->mAh);
+}
+
+void printEnergyDays(Print &out)
+{
+  // Saved daily summaries (cold boot)
+  LOCK_CACHE();
+  prefs.begin("tempo", true);
+  for (int i = 0; i < ENERGY_DAYS; i++)
+  {
+    char key[8];
+    sprintf(key, "energy%d", i);
+    EnergyDay energy;
+    if (prefs.getBytes(key, &energy, sizeof(energy)) == sizeof(energy) && energy.day != 0) printEnergyDay(out, &energy);
+  }
+  prefs.end();
+  UNLOCK_CACHE();
+}
+
+void endWake(const long sleepTime)
+{
+  // This wake and the deep sleep before it, in the summary of the day (saved at each wake : a wake is minutes apart)
+  radioOff();
+  int64_t active = esp_timer_get_time();
+  long today = energyDay.day;
+  if (isClockSet())
+  {
+    tm now;
+    toLocalTime(time(nullptr), &now);
+    today = dayNumber(now.tm_year+1900, now.tm_mon+1, now.tm_mday);
+  }
+  if (today != energyDay.day)
+  {
+    energyDay = {0};
+    energyDay.day = today;
+  }
+  uint64_t sleep = lastSleepTime * 1000000ULL;
+  float charge = getCharge(radioUs, active, sleep);
+  energyDay.wakes++;
+  for (int stage = 0; stage < STAGE_COUNT; stage++) energyDay.stageUs[stage] += stageUs[stage];
+  energyDay.radioUs += radioUs;
+  energyDay.activeUs += active;
+  energyDay.sleepUs += sleep;
+  energyDay.mAh += charge;
+  lastSleepTime = sleepTime;
+  if (today != 0)
+  {
+    char key[8];
+    sprintf(key, "energy%ld", today % ENERGY_DAYS);
+    LOCK_CACHE();
+    prefs.begin("tempo", false);
+    prefs.putBytes(key, &energyDay, sizeof(energyDay));
+    prefs.end();
+    UNLOCK_CACHE();
+  }
+
+  // This wake, then the day
+  for (int stage = 0; stage < STAGE_COUNT; stage++) Serial.printf("%s : %u ms\n", STAGE_NAMES[stage], (unsigned)(stageUs[stage]/1000));
+  Serial.printf("Wake : active %lld ms, radio %lld ms, previous sleep %ld s, %.4f mAh\n", active/1000, radioUs/1000, (long)(sleep/1000000), charge);
+  if (today != 0) printEnergyDay(Serial, &energyDay);
+}
+#else
+inline void startStage() {}
+inline void endStage(const Stage stage) {}
+inline void radioOn() {}
+inline void endWake(const long sleepTime) {}
+#endif
 
-/***********************************************************************************
-  Constants
-***********************************************************************************/
+long secondsUntil(const long today, const int dayOffset, const int hour, const int minute)
+{
+  // Seconds from now until a local time of the day J+dayOffset
+  return localToUTC(today + dayOffset, hour*3600L + minute*60L) - time(nullptr);
+}
 
-// Local network access point
-const char *SSID = "--------";
-const char *PWD = "--------"; 
+long publishedEnd(const tm *nowPtr)
+{
+  // Day after the last one that may have a published color : J+2 after the J+1 publication, else J+1
+  long today = dayNumber(nowPtr->tm_year+1900, nowPtr->tm_mon+1, nowPtr->tm_mday);
+  return (nowPtr->tm_hour*60 + nowPtr->tm_min < PUBLICATION_HOUR*60 + PUBLICATION_MINUTE) ? today+1 : today+2;
+}
 
-// NTP server (=>UTC time) and Time zone
-const char* NTP_SERVER = "pool.ntp.org";  // Server address (or "ntp.obspm.fr", "ntp.unice.fr", ...) 
-const char* TIME_ZONE = "CET-1CEST,M3.5.0,M10.5.0/3"; // Europe/Paris time zone 
+bool isUpToDate(const tm *nowPtr)
+{
+  // J color known, and J+1 color known or not yet published
+  long today = dayNumber(nowPtr->tm_year+1900, nowPtr->tm_mon+1, nowPtr->tm_mday);
+  if (getCachedColor(today) == TempoColor::UNDEFINED) return false;
+  if (getCachedColor(today+1) != TempoColor::UNDEFINED) return true;
+  return nowPtr->tm_hour*60 + nowPtr->tm_min < PUBLICATION_HOUR*60 + PUBLICATION_MINUTE;
+}
 
-// RTE basic authorization
-const char *AUTH = "--------";
+void sleepUntilNextWake()
+{
+  // Next wake : after midnight, after the J+1 publication, or a retry with backoff
+  tm now;
+  toLocalTime(time(nullptr), &now);
+  long today = dayNumber(now.tm_year+1900, now.tm_mon+1, now.tm_mday);
+  long midnight = isClockSet() ? secondsUntil(today, 1, 0, MIDNIGHT_WAKE_MINUTE) : RETRY_MAX;
+  long sleepTime;
+  if (isClockSet() && isUpToDate(&now))
+  {
+    schedulerState.retries = 0;
+    if (getCachedColor(today+1) != TempoColor::UNDEFINED) sleepTime = midnight;
+    else sleepTime = secondsUntil(today, 0, PUBLICATION_HOUR, PUBLICATION_MINUTE);
+  }
+  else
+  {
+    sleepTime = min(RETRY_FIRST << min(schedulerState.retries, 4), RETRY_MAX);
+    sleepTime = min(sleepTime + (long)(esp_random()%60), midnight);  // Jitter : devices out of lockstep
+    schedulerState.retries++;
+  }
+  sleepTime = max(sleepTime, 1L);
+#ifdef DEBUG_PRINT
+  Serial.printf("Deep sleep : %ld s (retries=%d)\n", sleepTime, schedulerState.retries);
+#endif
+  endWake(sleepTime);
 
-// Debug print
-// #define DEBUG_PRINT
+  // Radio off, RTC timer wake up
+  WiFi.disconnect(true);
+  WiFi.mode(WIFI_OFF);
+  esp_sleep_enable_timer_wakeup(sleepTime * 1000000ULL);
+  esp_deep_sleep_start();
+}
 
-/***********************************************************************************
-  Global variables
-***********************************************************************************/
+bool isFetchAllowed()
+{
+  // Backoff (RETRY_FIRST to RETRY_MAX, across the wakes) of the fetches that leave published days unknown
+  return fetchRetries == 0 || time(nullptr) >= nextFetchTime;
+}
 
-HTTPClient http;
-static char payload[1000];
-JsonDocument doc; 
+void updateFetchBackoff(const bool complete)
+{
+  if (complete) fetchRetries = 0;
+  else
+  {
+    nextFetchTime = time(nullptr) + min(RETRY_FIRST << min(fetchRetries, 4), RETRY_MAX);
+    fetchRetries++;
+  }
+}
 
-/***********************************************************************************
-  Tool functions
-***********************************************************************************/
+bool isRangeKnown(const long startN, const long endN)
+{
+  for (long n = startN; n < endN; n++) if (getCachedColor(n) == TempoColor::UNDEFINED) return false;
+  return true;
+}
 
-void setTimeZone(const char *timeZone)
+bool prefetchSeason(const long today)
 {
-  // To work with Local time (custom and RTC)
-  setenv("TZ", timeZone, 1); 
-  tzset();
+  // First boot or new season : colors of the season until J, in a few range requests (then J and J+1 only)
+  // (days still missing, refused chunk or gaps in the values, asked again with backoff)
+  long seasonStart = dayNumber(seasonOf(today), 9, 1);
+  long n = seasonStart;
+  while (n <= today && getCachedColor(n) != TempoColor::UNDEFINED) n++;
+  if (n > today) return true;
+  if (!isFetchAllowed()) return false;
+  for (; n <= today; n += PREFETCH_CHUNK)
+  {
+    int startYear, startMonth, startDay, endYear, endMonth, endDay;
+    long endN = min(n + PREFETCH_CHUNK, today + 1);
+    civilDate(n, &startYear, &startMonth, &startDay);
+    civilDate(endN, &endYear, &endMonth, &endDay);
+    int nDays;
+    getTempoColorRange(startYear, startMonth, startDay, endYear, endMonth, endDay, nullptr, 0, &nDays);  // Colors in the cache only
+  }
+  bool complete = isRangeKnown(seasonStart, today + 1);
+  updateFetchBackoff(complete);
+  return complete;
 }
 
-void initRTC(const char *timeZone)
+void countSeasonColors(const long today, int counts[4])
 {
-  // Set RTC with Local time, using an NTP server
-  configTime(0, 0, "pool.ntp.org"); // To get UTC time
-  tm time;
-  getLocalTime(&time);    
-  setTimeZone(timeZone);  // Transform to Local time
+  // Colors of the season days until today (cache only)
+  memset(counts, 0, 4*sizeof(int));
+  for (long n = dayNumber(seasonOf(today), 9, 1); n <= today; n++) counts[(int)getCachedColor(n)]++;
 }
 
-bool getCustomTime(const int year, const int month, const int day, const int hour, const int minute, const int second, tm *timePtr)
+void buildLookahead(const long today)
 {
-  // Set a time (date) without DST indication
-  *timePtr = {0};
-  timePtr->tm_year = year - 1900; 
-  timePtr->tm_mon = month-1;
-  timePtr->tm_mday = day;
-  timePtr->tm_hour = hour;
-  timePtr->tm_min = minute;
-  timePtr->tm_sec = second;
-  time_t t = mktime(timePtr);
-  timePtr->tm_hour--;
-  time_t t1 = mktime(timePtr);
-  memcpy(timePtr, localtime(&t), sizeof(tm)); 
-  if (localtime(&t1)->tm_isdst==1)
-  {
-    if (timePtr->tm_isdst==0) return false;  // Ambigous
-    else timePtr->tm_hour--;
+  // Tariff periods of the Tempo days J-1 to J+1 (cache only), rebuilt only if the day or a color has changed
+  const long HP = TEMPO_DAY_HOUR*3600L, HC = OFFPEAK_HOUR*3600L;
+  static long builtToday = 0;
+  static TempoColor builtColors[3];
+  TempoColor colors[3];
+  for (int i = 0; i < 3; i++) colors[i] = getCachedColor(today-1+i);
+  if (today == builtToday && memcmp(colors, builtColors, sizeof(colors)) == 0) return;
+  TariffPeriod *periods = lookahead[1-lookaheadActive];
+  periods[0] = {0, TempoColor::UNDEFINED, false};
+  for (int i = 0; i < 3; i++)
+  {
+    periods[1+2*i] = {localToUTC(today-1+i, HP), colors[i], true};
+    periods[2+2*i] = {localToUTC(today-1+i, HC), colors[i], false};
   }
-  return true;
+  periods[7] = {localToUTC(today+2, HP), TempoColor::UNDEFINED, false};
+  periods[8] = {std::numeric_limits<time_t>::max(), TempoColor::UNDEFINED, false};
+  lookaheadActive = 1-lookaheadActive;
+  builtToday = today;
+  memcpy(builtColors, colors, sizeof(colors));
 }
 
-bool getAccessToken(String *tokenPtr)
+TempoColor colorAt(const time_t t, bool *peakPtr)
 {
-  // Local variables
-  bool okToken = false;
-  String url = "https://digital.iservices.rte-france.com/token/oauth/";
-  String auth = "Basic " + String(AUTH);
-#ifdef DEBUG_PRINT
-  Serial.printf("URL : %s\nAuthorization : %s\n", url.c_str(), auth.c_str());
+  // Tariff at UTC time t (UNDEFINED out of J-1 to J+1), without any time conversion :
+  // the cursor stays on the current period, and moves only at a boundary or after a rebuild
+  static int cursor = 0;
+  const TariffPeriod *periods = lookahead[lookaheadActive];
+  int i = cursor;
+  if (t < periods[i].start || t >= periods[i+1].start)
+  {
+    for (i = 0; i < TARIFF_PERIODS-2 && t >= periods[i+1].start; i++);
+    cursor = i;
+  }
+  *peakPtr = periods[i].peak;
+  return periods[i].color;
+}
+
+#ifdef MQTT_PUBLISH
+void onMqttEvent(void *args, esp_event_base_t base, int32_t id, void *data)
+{
+  // MQTT task
+  if (id == MQTT_EVENT_CONNECTED) mqttConnected = true;
+  else if (id == MQTT_EVENT_DISCONNECTED) mqttConnected = false;
+  else if (id == MQTT_EVENT_PUBLISHED)
+  {
+    ackedIds[nAcked % 4] = ((esp_mqtt_event_handle_t)data)->msg_id;
+    nAcked++;
+  }
+}
+
+void startMqtt()
+{
+  // Asynchronous client (reconnects by itself), "offline" status as last will
+  esp_mqtt_client_config_t config = {};
+#if ESP_IDF_VERSION_MAJOR >= 5
+  config.broker.address.uri = MQTT_URI;
+  config.session.last_will.topic = MQTT_TOPIC_STATUS;
+  config.session.last_will.msg = "{\"status\":\"offline\"}";
+  config.session.last_will.retain = 1;
+#else
+  config.uri = MQTT_URI;
+  config.lwt_topic = MQTT_TOPIC_STATUS;
+  config.lwt_msg = "{\"status\":\"offline\"}";
+  config.lwt_retain = 1;
 #endif
+  mqttClient = esp_mqtt_client_init(&config);
+  esp_mqtt_client_register_event(mqttClient, MQTT_EVENT_ANY, onMqttEvent, NULL);
+  esp_mqtt_client_start(mqttClient);
+}
+
+bool waitMqtt(const unsigned long timeout)
+{
+  unsigned long start = millis();
+  while (!mqttConnected && millis() - start < timeout) delay(10);
+  return mqttConnected;
+}
 
-  // HTTP Get request
-  http.begin(url);
-	http.setTimeout(1000);
-  http.addHeader("Authorization", auth);
-  http.addHeader("Accept", "application/json");
+bool isAcked(const int msgId)
+{
+  for (int k = 0; k < 4; k++) if (ackedIds[k] == msgId) return true;
+  return false;
+}
 
-  // Send and decode
-  if (http.GET() == 200) 
+bool commitPublished()
+{
+  // Acknowledged J and J+1 messages (QoS 1) become the published ones, true if none is pending
+  for (int i = 0; i < 2; i++)
   {
-    strcpy(payload, http.getString().c_str());
-    if (!deserializeJson(doc, payload))
+    if (pendingIds[i] > 0 && isAcked(pendingIds[i]))
     {
-      serializeJsonPretty(doc, payload);
-      const char* token = doc["access_token"];
-#ifdef DEBUG_PRINT
-      Serial.printf("Payload : \n%s\nToken : %s\n", payload, token);
+      published[i] = pendingDays[i];
+      pendingIds[i] = 0;
+    }
+  }
+  return pendingIds[0] == 0 && pendingIds[1] == 0;
+}
+
+bool waitPublished(const unsigned long timeout)
+{
+  // Acknowledgements of the pending messages, before a deep sleep
+  unsigned long start = millis();
+  while (!commitPublished() && millis() - start < timeout) delay(10);
+  return commitPublished();
+}
+
+bool isPublished(const int i, const long n, TempoDay *tempoDayPtr)
+{
+  // Message i (0 for J, 1 for J+1) up to date with the color of day n
+  int year, month, day;
+  civilDate(n, &year, &month, &day);
+  sprintf(tempoDayPtr->date, "%04d-%02d-%02d", year, month, day);
+  tempoDayPtr->color = getCachedColor(n);
+  return !strcmp(tempoDayPtr->date, published[i].date) && tempoDayPtr->color == published[i].color;
+}
+
+bool isPublished(const long today)
+{
+  TempoDay tempoDay;
+  return isPublished(0, today, &tempoDay) && isPublished(1, today+1, &tempoDay);
+}
+
+void publishColor(const int i, const char *topic, const long n)
+{
+  // Retained message, only if the day or its color changed since the last acknowledged one
+  // (the same pending message sent again if not acknowledged within MQTT_TIMEOUT)
+  TempoDay tempoDay;
+  if (isPublished(i, n, &tempoDay)) return;
+  if (pendingIds[i] > 0 && !strcmp(tempoDay.date, pendingDays[i].date) && tempoDay.color == pendingDays[i].color
+      && millis() - pendingMillis[i] < MQTT_TIMEOUT) return;
+  char message[64];
+  int length = sprintf(message, "{\"date\":\"%s\",\"color\":\"%s\"}", tempoDay.date, colorName(tempoDay.color));
+  if (!mqttConnected) return;
+  int msgId = esp_mqtt_client_publish(mqttClient, topic, message, length, 1, 1);
+  if (msgId <= 0) return;
+  pendingDays[i] = tempoDay;
+  pendingIds[i] = msgId;
+  pendingMillis[i] = millis();
+}
+
+void publishColors(const long today)
+{
+  commitPublished();
+  publishColor(0, MQTT_TOPIC_J, today);
+  publishColor(1, MQTT_TOPIC_J1, today+1);
+}
+
+void publishHeartbeat()
+{
+  // Status (retained, replaced by the last will) every HEARTBEAT_PERIOD
+  if (!mqttConnected || (lastHeartbeat != 0 && millis() - lastHeartbeat < HEARTBEAT_PERIOD)) return;
+  char message[64];
+  int length = sprintf(message, "{\"status\":\"online\",\"uptime\":%lu}", millis()/1000);
+  if (esp_mqtt_client_publish(mqttClient, MQTT_TOPIC_STATUS, message, length, 0, 1) >= 0) lastHeartbeat = millis();
+}
 #endif
-      *tokenPtr = String(token);
-      okToken = true;
+
+#ifdef TEMPO_SERVICE_TASK
+void fetchNewColors(const long startN, const long endN)
+{
+  // Fetch the days of [startN, endN[ (at most 2), and publish the new colors
+  TempoColor known[2];
+  for (long n = startN; n < endN; n++) known[n-startN] = getCachedColor(n);
+  int startYear, startMonth, startDay, endYear, endMonth, endDay;
+  civilDate(startN, &startYear, &startMonth, &startDay);
+  civilDate(endN, &endYear, &endMonth, &endDay);
+  TempoDay days[2];
+  int nDays;
+  if (!getTempoColorRange(startYear, startMonth, startDay, endYear, endMonth, endDay, days, 2, &nDays)) return;
+  for (long n = startN; n < endN; n++)
+  {
+    TempoDay update;
+    update.color = getCachedColor(n);
+    if (update.color == known[n-startN]) continue;
+    int year, month, day;
+    civilDate(n, &year, &month, &day);
+    sprintf(update.date, "%04d-%02d-%02d", year, month, day);
+    xQueueSend(updateQueue, &update, 0);
+  }
+}
+
+bool requestRange(const long startN, const long endN)
+{
+  // Range asked to the service task, unless a pending one covers it (non blocking, false if not pending)
+  if (xSemaphoreTakeRecursive(cacheMutex, 0) != pdTRUE) return false;
+  bool pending = false;
+  for (int i = 0; i < nPendingRanges && !pending; i++) pending = (pendingRanges[i].startN <= startN && endN <= pendingRanges[i].endN);
+  if (!pending && nPendingRanges < PENDING_RANGES)
+  {
+    pendingRanges[nPendingRanges++] = {startN, endN};
+    xTaskNotifyGive(serviceTask);
+    pending = true;
+  }
+  xSemaphoreGiveRecursive(cacheMutex);
+  return pending;
+}
+
+void fetchPendingRange(const long lastN)
+{
+  // Oldest pending range, its days before lastN (published) fetched once when the backoff allows it
+  LOCK_CACHE();
+  DayRange range = pendingRanges[0];
+  bool any = (nPendingRanges > 0);
+  UNLOCK_CACHE();
+  if (!any) return;
+  long endN = min(range.endN, lastN);
+  if (range.startN < endN && !isRangeKnown(range.startN, endN))
+  {
+    if (!isFetchAllowed()) return;  // Still pending
+    if (endN - range.startN <= 2) fetchNewColors(range.startN, endN);  // Asked by the application : colors published
+    else
+    {
+      int startYear, startMonth, startDay, endYear, endMonth, endDay;
+      civilDate(range.startN, &startYear, &startMonth, &startDay);
+      civilDate(endN, &endYear, &endMonth, &endDay);
+      int nDays;
+      getTempoColorRange(startYear, startMonth, startDay, endYear, endMonth, endDay, nullptr, 0, &nDays);  // Cache only
     }
+    updateFetchBackoff(isRangeKnown(range.startN, endN));
   }
-  http.end();
-  return okToken;
+  LOCK_CACHE();
+  nPendingRanges--;
+  memmove(pendingRanges, pendingRanges+1, nPendingRanges*sizeof(DayRange));
+  UNLOCK_CACHE();
+  if (nPendingRanges > 0) xTaskNotifyGive(serviceTask);  // Next one at once
 }
 
-bool getTempoDayColor(const int year, const int month, const int day, const String *tokenPtr, String *colorPtr)
+void startWatchdog()
 {
-  // Local variables
-  bool okColor = false;
-  String url = "https://digital.iservices.rte-france.com/open_api/tempo_like_supply_contract/v1/tempo_like_calendars?start_date=YYYY-MM-DDThh:mm:sszzzzzz&end_date=YYYY-MM-DDThh:mm:sszzzzzz";
-
-  // Copy dates in URL with ISO 8601 format
-  tm timeStart; getCustomTime(year, month, day, 0, 0, 0, &timeStart);
-  tm timeEnd; getCustomTime(year, month, day+1, 0, 0, 0, &timeEnd);
-  strftime((char*)(url.c_str())+112, 23, "%FT%T%z", &timeStart);
-  strftime((char*)(url.c_str())+147, 23, "%FT%T%z", &timeEnd);
-  strcpy((char*)(url.c_str())+134, ":00");
-  strcpy((char*)(url.c_str())+169, ":00"); 
-  url[137]='&';
-  String auth = "Bearer " + *tokenPtr;
-#ifdef DEBUG_PRINT
-  Serial.printf("URL : %s\nAuthorization : %s\n", url.c_str(), auth.c_str());
+  // Task watchdog of the service task (also the loop task, see setup), timeout for its longest step
+#if ESP_IDF_VERSION_MAJOR >= 5
+  esp_task_wdt_config_t config = {};
+  config.timeout_ms = WATCHDOG_TIMEOUT*1000;
+  config.idle_core_mask = 1;  // Idle task of core 0, as configured by default
+  config.trigger_panic = true;
+  if (esp_task_wdt_reconfigure(&config) != ESP_OK) esp_task_wdt_init(&config);
+#else
+  esp_task_wdt_init(WATCHDOG_TIMEOUT, true);
+#endif
+  esp_task_wdt_add(NULL);
+}
+
+void tempoServiceTask(void *parameter)
+{
+  // Owner of the Wifi connection, the HTTP client, the token and the cache writes :
+  // a state machine of bounded steps, the watchdog fed between them and during the request waits
+  startWatchdog();
+  ServiceState state = SERVICE_CONNECT;
+  bool started = false;
+  while (true)
+  {
+    esp_task_wdt_reset();
+    switch (state)
+    {
+    case SERVICE_CONNECT:
+      // Wifi connection (WIFI_TIMEOUT), retried after SERVICE_PERIOD
+      state = !connectWifi(WIFI_TIMEOUT) ? SERVICE_WAIT : started ? SERVICE_CHECK : SERVICE_START;
+      break;
+    case SERVICE_START:
+      // First connection
+      startTimeSync(TIME_ZONE);
+      initSession();
+#ifdef MQTT_PUBLISH
+      startMqtt();
+#endif
+      started = true;
+      state = SERVICE_CHECK;
+      break;
+    case SERVICE_WAIT:
+      // Request of the application or of a peer, or SERVICE_PERIOD
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SERVICE_PERIOD));
+      state = (WiFi.status() == WL_CONNECTED && started) ? SERVICE_CHECK : SERVICE_CONNECT;
+      break;
+    case SERVICE_CHECK:
+      // Season, requested days and J and J+1, only the published ones (J+1 not before its publication),
+      // the fetches that leave days unknown retried with backoff
+      if (!timeSyncStarted && needsTimeSync()) startTimeSync(TIME_ZONE);
+      if (isClockSet())
+      {
+        tm now;
+        toLocalTime(time(nullptr), &now);
+        long today = dayNumber(now.tm_year+1900, now.tm_mon+1, now.tm_mday);
+        prefetchSeason(today);
+        fetchPendingRange(publishedEnd(&now));
+        if (!isUpToDate(&now) && isFetchAllowed())
+        {
+          fetchNewColors(today, publishedEnd(&now));
+          updateFetchBackoff(isUpToDate(&now));
+        }
+        buildLookahead(today);
+#ifdef MQTT_PUBLISH
+        publishColors(today);
+#endif
+      }
+#ifdef MQTT_PUBLISH
+      publishHeartbeat();
 #endif
+      state = SERVICE_WAIT;
+      break;
+    }
+  }
+}
 
-  // HTTP Get request
-  http.begin(url);
-	http.setTimeout(1000);
-  http.addHeader("Authorization", auth);
-  http.addHeader("Accept", "application/json");
+void startTempoService()
+{
+  cacheMutex = xSemaphoreCreateRecursiveMutex();
+  updateQueue = xQueueCreate(8, sizeof(TempoDay));
+  xTaskCreatePinnedToCore(tempoServiceTask, "tempo", 8192, NULL, 1, &serviceTask, 0);
+}
 
-  // Send and decode response
-  int code = http.GET();
-  if (code == 200) 
+bool tempoGetColor(const int year, const int month, const int day, TempoColor *colorPtr)
+{
+  // Non blocking lookup for the application : cached color, else a request to the service task
+  long n = dayNumber(year, month, day);
+  *colorPtr = TempoColor::UNDEFINED;
+  if (xSemaphoreTakeRecursive(cacheMutex, 0) == pdTRUE)
+  {
+    if (seasonCache.season == seasonOf(n)) *colorPtr = getCachedColor(n);  // No NVS read
+    xSemaphoreGiveRecursive(cacheMutex);
+  }
+  if (*colorPtr != TempoColor::UNDEFINED) return true;
+  if (isClockSet())
+  {
+    tm now;
+    toLocalTime(time(nullptr), &now);
+    if (n >= publishedEnd(&now)) return false;  // Not published yet
+  }
+  requestRange(n, n+1);
+  return false;
+}
+#endif
+
+int formatHealth(char *buf, const size_t size)
+{
+  // Health (JSON) : uptime, last successful request, cache hit ratio, heap low-water mark and retries
+  uint32_t ranges = cacheHits + cacheMisses;
+  long lastFetchAge = (lastFetch != 0 && isClockSet()) ? (long)(time(nullptr) - lastFetch) : -1;
+  return snprintf(buf, size, "{\"uptime\":%ld,\"lastFetch\":%ld,\"lastFetchAge\":%ld,\"cacheHits\":%u,\"cacheMisses\":%u,\"hitRatio\":%.3f,"
+    "\"fetchErrors\":%u,\"retries\":%u,\"freeHeap\":%u,\"minFreeHeap\":%u}",
+    (long)(esp_timer_get_time()/1000000), (long)lastFetch, lastFetchAge, (unsigned)cacheHits, (unsigned)cacheMisses, ranges ? (float)cacheHits/ranges : 0.0f,
+    (unsigned)fetchErrors, (unsigned)retryCount, (unsigned)esp_get_free_heap_size(), (unsigned)esp_get_minimum_free_heap_size());
+}
+
+void printHealth(Print &out)
+{
+  char buf[256];
+  formatHealth(buf, sizeof(buf));
+  out.printf("Health : %s\n", buf);
+}
+
+#ifdef LAN_SERVER
+bool parseDate(const char *text, long *nPtr)
+{
+  // YYYY-MM-DD
+  int year, month, day;
+  if (sscanf(text, "%4d-%2d-%2d", &year, &month, &day) != 3 || month < 1 || month > 12 || day < 1 || day > 31) return false;
+  *nPtr = dayNumber(year, month, day);
+  return true;
+}
+
+int formatColor(char *buf, const size_t size, const char *name, const long n, SeasonView *viewPtr)
+{
+  // "name":{"date":"YYYY-MM-DD","color":"..."} (no name in an array), from the cache without loading a season
+  int year, month, day;
+  civilDate(n, &year, &month, &day);
+  return snprintf(buf, size, "%s%s%s{\"date\":\"%04d-%02d-%02d\",\"color\":\"%s\"}",
+    name ? "\"" : "", name ? name : "", name ? "\":" : "", year, month, day, colorName(peekCachedColor(n, viewPtr)));
+}
+
+void handleToday()
+{
+  // J and J+1 colors from the cache
+  if (!isClockSet())
   {
-    strcpy(payload, http.getString().c_str());
-    if (!deserializeJson(doc, payload))
+    server.send(503, "application/json", "{\"error\":\"clock not set\"}");
+    return;
+  }
+  tm now;
+  getLocalTime(&now, 0);
+  long today = dayNumber(now.tm_year+1900, now.tm_mon+1, now.tm_mday);
+  char buf[128];
+  SeasonView view = {0};
+  int length = sprintf(buf, "{");
+  length += formatColor(buf+length, sizeof(buf)-length, "J", today, &view);
+  length += sprintf(buf+length, ",");
+  length += formatColor(buf+length, sizeof(buf)-length, "J+1", today+1, &view);
+  sprintf(buf+length, "}");
+  server.send(200, "application/json", buf);
+}
+
+#ifdef FLEET_MODE
+bool preparePeerRange(const long startN, const long endN)
+{
+  // Fleet peer request : the published days of [startN, endN[ (until today) known, else asked to the service task
+  // (false until they are received : the handler never waits for RTE)
+  if (!isClockSet()) return false;
+  tm now;
+  getLocalTime(&now, 0);
+  long lastN = min(endN, dayNumber(now.tm_year+1900, now.tm_mon+1, now.tm_mday) + 1);
+  SeasonView view = {0};
+  long n = startN;
+  while (n < lastN && peekCachedColor(n, &view) != TempoColor::UNDEFINED) n++;
+  if (n >= lastN) return true;
+  requestRange(n, lastN);
+  return false;
+}
+#endif
+
+void handleRange()
+{
+  // Colors of [start, end[ from the cache, sent in chunks (UNDEFINED if unknown)
+  long startN, endN;
+  if (!parseDate(server.arg("start").c_str(), &startN) || !parseDate(server.arg("end").c_str(), &endN) || endN <= startN || endN - startN > 366)
+  {
+    server.send(400, "application/json", "{\"error\":\"start and end dates YYYY-MM-DD expected\"}");
+    return;
+  }
+#ifdef FLEET_MODE
+  if (server.hasArg("fetch") && !preparePeerRange(startN, endN))
+  {
+    server.sendHeader("Retry-After", "60");
+    server.send(503, "application/json", "{\"error\":\"colors not available yet\"}");
+    return;
+  }
+#endif
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "{\"values\":[");
+  char buf[512];
+  int length = 0;
+  SeasonView view = {0};
+  for (long n = startN; n < endN; n++)
+  {
+    length += formatColor(buf+length, sizeof(buf)-length, nullptr, n, &view);
+    if (n < endN-1) buf[length++] = ',';
+    if (length > (int)sizeof(buf) - 64)
     {
-      serializeJsonPretty(doc, payload);
-      const char* color = doc["tempo_like_calendars"]["values"][0]["value"];
-#ifdef DEBUG_PRINT
-      Serial.printf("Payload : \n%s\nColor : %s\n", payload, color);
+      server.sendContent(buf, length);
+      length = 0;
+    }
+  }
+  length += sprintf(buf+length, "]}");
+  server.sendContent(buf, length);
+  server.sendContent("");  // Last chunk
+}
+
+void handleHealth()
+{
+  char buf[256];
+  formatHealth(buf, sizeof(buf));
+  server.send(200, "application/json", buf);
+}
+
+#ifdef METRICS
+void handleMetrics()
+{
+  char buf[512];
+  BufferPrint out(buf, sizeof(buf));
+  printMetrics(out);
+  server.send(200, "text/plain", buf);
+}
 #endif
-      *colorPtr = String(color);
-      okColor = true;
+
+void startLanServer()
+{
+  server.on("/tempo", HTTP_GET, handleToday);
+  server.on("/health", HTTP_GET, handleHealth);
+#ifdef METRICS
+  server.on("/metrics", HTTP_GET, handleMetrics);
+#endif
+  server.on("/tempo/range", HTTP_GET, handleRange);
+  server.onNotFound([]() { server.send(404, "application/json", "{\"error\":\"not found\"}"); });
+  server.begin();
+}
+#endif
+
+#ifdef BENCHMARK
+void runBenchmark()
+{
+  // Recorded payload of a whole season (2099, not a real season : nothing saved in NVS)
+  Serial.println("\nBENCHMARK");
+  const long startN = dayNumber(2099, 9, 1);
+  const int N_DAYS = 365;
+  static const char HEADER[] = "{\"tempo_like_calendars\":{\"start_date\":\"2099-09-01T00:00:00+02:00\",\"end_date\":\"2100-09-01T00:00:00+02:00\",\"values\":[";
+  static const char VALUE_FORMAT[] = "{\"start_date\":\"%s\",\"end_date\":\"%s\",\"value\":\"%s\",\"updated_date\":\"%s\"}%s";
+  char date[26];
+  formatDate(date, startN);
+  const size_t VALUE_SIZE = snprintf(nullptr, 0, VALUE_FORMAT, date, date, "WHITE", date, ",");  // Longest element
+  const size_t capacity = sizeof(HEADER) + N_DAYS*VALUE_SIZE + sizeof("]}}");
+  char *payload = (char *)malloc(capacity);
+  if (payload == nullptr) return;
+  char *ptr = payload + snprintf(payload, capacity, "%s", HEADER);
+  for (long n = startN+N_DAYS-1; n >= startN; n--)
+  {
+    char start[26], end[26];
+    formatDate(start, n);
+    formatDate(end, n+1);
+    size_t remaining = capacity - (ptr - payload);
+    int length = snprintf(ptr, remaining, VALUE_FORMAT, start, end, COLOR_NAMES[1 + n%3], start, (n > startN) ? "," : "");
+    if (length < 0 || (size_t)length >= remaining)
+    {
+      free(payload);
+      return;
     }
+    ptr += length;
   }
-  else if (code == 400 )
+  ptr += snprintf(ptr, capacity - (ptr - payload), "]}}");
+  size_t size = ptr - payload;
+
+  // Decoding throughput
+  const int RUNS = 10;
+  MemoryStream body(payload, size);
+  int64_t t = esp_timer_get_time();
+  bool ok = true;
+  int changes, newDays = 0, repeatedDays = 0;  // First run (empty cache), then the same days again
+  for (int run = 0; run < RUNS; run++)
   {
-    *colorPtr = "UNDEFINED";
-    okColor = true;
+    body.rewind();
+    ok &= decodeCalendar(body, &changes);
+    if (run == 0) newDays = changes;
+    else repeatedDays += changes;
   }
-  http.end();
-  return okColor;
+  t = esp_timer_get_time() - t;
+  bool okColors = ok && newDays == N_DAYS && repeatedDays == 0;
+  for (long n = startN; n < startN+N_DAYS; n++) okColors &= (getCachedColor(n) == (TempoColor)(1 + n%3));
+  Serial.printf("Decode : %u bytes, %d days in %lld us (%.0f kB/s), %d then %d changes, %s\n", size, N_DAYS, t/RUNS, 1000.0*size*RUNS/t, newDays, repeatedDays, okColors ? "OK" : "ERROR");
+  free(payload);
+  seasonCache = {0};  // Fake season discarded
+
+  // URL formatting
+  const int LOOPS = 1000;
+  t = esp_timer_get_time();
+  for (int i = 0; i < LOOPS; i++) setCalendarURL(startN + i, startN + i + 2);
+  t = esp_timer_get_time() - t;
+  Serial.printf("URL formatting : %.2f us\n", (float)t/LOOPS);
+
+  // Cache lookups (loaded season)
+  long today = dayNumber(2024, 2, 12);
+  getCachedColor(today);
+  volatile TempoColor color;
+  t = esp_timer_get_time();
+  for (int i = 0; i < LOOPS; i++) color = getCachedColor(today - i%150);
+  t = esp_timer_get_time() - t;
+  Serial.printf("Cache lookup : %.3f us\n", (float)t/LOOPS);
+
+  // DST : midnight offsets of all the days of 2000-2099, compared with newlib (TIME_ZONE)
+  setTimeZone(TIME_ZONE);
+  int errors = 0;
+  for (long n = dayNumber(2000, 1, 1); n < dayNumber(2100, 1, 1); n++)
+  {
+    int year, month, day;
+    civilDate(n, &year, &month, &day);
+    tm time = {0};
+    time.tm_year = year-1900;
+    time.tm_mon = month-1;
+    time.tm_mday = day;
+    time.tm_isdst = -1;
+    mktime(&time);
+    if (midnightOffset(n) != (time.tm_isdst ? 120 : 60)) errors++;
+  }
+  Serial.printf("DST midnight offsets 2000-2099 : %d error(s)\n", errors);
+
+  // Local times : time zone table compared with newlib (every hour of 2024), and the changes of the October and March Sundays
+  errors = 0;
+  int64_t tTable = 0, tNewlib = 0;
+  for (time_t s = localToUTC(dayNumber(2024, 1, 1), 0); s < localToUTC(dayNumber(2025, 1, 1), 0); s += 3600)
+  {
+    tm local, newlib;
+    t = esp_timer_get_time();
+    toLocalTime(s, &local);
+    tTable += esp_timer_get_time() - t;
+    t = esp_timer_get_time();
+    localtime_r(&s, &newlib);
+    tNewlib += esp_timer_get_time() - t;
+    if (local.tm_hour != newlib.tm_hour || local.tm_mday != newlib.tm_mday || local.tm_isdst != newlib.tm_isdst) errors++;
+  }
+  LocalTimeKind october, march;
+  localToUTC(dayNumber(2024, 10, 27), 2*3600L + 1800, &october);
+  localToUTC(dayNumber(2024, 3, 31), 2*3600L + 1800, &march);
+  errors += (october != LocalTimeKind::AMBIGUOUS) + (march != LocalTimeKind::NONEXISTENT);
+  Serial.printf("Local time : %.3f us (newlib %.3f us), %d error(s)\n", (float)tTable/8784, (float)tNewlib/8784, errors);
+
+  // Tariff lookups, one per second over the lookahead days (2024-03-31, a DST change, is day J)
+  today = dayNumber(2024, 3, 31);
+  buildLookahead(today);
+  time_t first = localToUTC(today-1, TEMPO_DAY_HOUR*3600L), last = localToUTC(today+2, TEMPO_DAY_HOUR*3600L);
+  int peakSeconds = 0;
+  bool peak;
+  t = esp_timer_get_time();
+  for (time_t s = first; s < last; s++)
+  {
+    color = colorAt(s, &peak);
+    peakSeconds += peak;
+  }
+  t = esp_timer_get_time() - t;
+  Serial.printf("Tariff lookup : %.3f us, %d HP hours (%s)\n", (float)t/(last-first), peakSeconds/3600, (peakSeconds == 3*16*3600) ? "OK" : "ERROR");
 }
+#endif
 
 /***********************************************************************************
   setup and loop functions
@@ -209,53 +2606,192 @@ void setup()
 {
   // Open serial port
   Serial.begin(115200);
-  while (!Serial);
+  while (!Serial && millis() < SERIAL_TIMEOUT) delay(10);
+
+#ifdef BENCHMARK
+  runBenchmark();
+  return;
+#endif
+
+#ifdef TEMPO_SERVICE_TASK
+  // Network work in the background (core 0), colors published to loop()
+  setTimeZone(TIME_ZONE);
+  startTempoService();
+#ifdef LAN_SERVER
+  startLanServer();
+#endif
+  enableLoopWDT();  // loop() never blocks
+  return;
+#endif
+
+#ifdef ENERGY_PROFILE
+  if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TIMER) printEnergyDays(Serial);
+#endif
+
+#ifdef DEEP_SLEEP_SCHEDULER
+  // Warm wake : the RTC clock and the cache may be enough, without the radio
+  setTimeZone(TIME_ZONE);
+  if (isClockSet())
+  {
+    tm now;
+    toLocalTime(time(nullptr), &now);
+#ifdef MQTT_PUBLISH
+    if (isUpToDate(&now) && isPublished(dayNumber(now.tm_year+1900, now.tm_mon+1, now.tm_mday))) sleepUntilNextWake();
+#else
+    if (isUpToDate(&now)) sleepUntilNextWake();
+#endif
+  }
+#endif
 
   // Connect to the Wifi access point 
-  WiFi.begin(SSID, PWD);
-  while (WiFi.status() != WL_CONNECTED); 
+  startStage();
+  radioOn();
+  bool okWifi = connectWifi(WIFI_TIMEOUT);
+  endStage(STAGE_WIFI);
+  if (!okWifi)
+  {
+    Serial.println("Error : cannot connect to the Wifi access point");
+#ifdef DEEP_SLEEP_SCHEDULER
+    sleepUntilNextWake();  // Retry later
+#endif
+    return;
+  }
 #ifdef DEBUG_PRINT
   Serial.printf("IP=%s RSSI=%d\n", WiFi.localIP().toString(), WiFi.RSSI());
 #endif
   Serial.println("\nACCESS TO THE RTE API \"TEMPO LIKE SUPPLY CONTRACT\"");
+#ifdef MQTT_PUBLISH
+  startMqtt();
+#endif
+
+  // Init RTC with Local time using an NTP server, in parallel with the token and custom days requests
+  startTimeSync(TIME_ZONE);
+  initSession();
 
-  // Get access token
+  // Get access token (cached), in fleet mode only when this node calls RTE
+#ifndef FLEET_MODE
   Serial.println("\nGET ACCESS TOKEN");
-  String token;
-  if (getAccessToken(&token)) Serial.printf("Token : %s\n", token.c_str());
+  const char *token;
+  startStage();
+  bool okToken = getToken(&token);
+  endStage(STAGE_TOKEN);
+  if (okToken) Serial.printf("Token : %s\n", token);
   else 
   {
     Serial.println("Error : cannot obtain access token");
-    exit(0);
+#ifdef DEEP_SLEEP_SCHEDULER
+    sleepUntilNextWake();  // Retry later
+#endif
+    return;
   }
+#endif
 
-  // Set time zone (not necessary after InitRTC)
-  setTimeZone(TIME_ZONE);
-
-  // Custom day Tempo color
-  Serial.println("\nGET CUSTOM DAY TEMPO COLOR");
-  String color;
-  Serial.println("12/2/2024 :");
-  if (getTempoDayColor(2024, 2, 11, &token, &color)) Serial.printf("Day J-1 Tempo color : %s\n", color.c_str());
-  if (getTempoDayColor(2024, 2, 12, &token, &color)) Serial.printf("Day J Tempo color : %s\n", color.c_str());
-  if (getTempoDayColor(2024, 2, 13, &token, &color)) Serial.printf("Day J+1 Tempo color : %s\n", color.c_str());
+  // Custom days Tempo colors, in one request
+  TempoDay days[3];
+  int nDays;
+#ifndef DEEP_SLEEP_SCHEDULER
+  Serial.println("\nGET CUSTOM DAYS TEMPO COLORS");
+  Serial.println("From 11/2/2024 to 13/2/2024 :");
+  startStage();
+  bool okCustom = getTempoColorRange(2024, 2, 11, 2024, 2, 14, days, 3, &nDays);
+  endStage(STAGE_CALENDAR);
+  if (okCustom)
+  {
+    for (int i = 0; i < nDays; i++) Serial.printf("%s Tempo color : %s\n", days[i].date, colorName(days[i].color));
+  }
+  else Serial.println("Error : cannot obtain Tempo colors");
+#endif
 
-  // Init RTC with Local time using an NTP server
-  initRTC(TIME_ZONE);
-  char buf[30];
+  // Wait for the RTC, required for the current day
+  startStage();
+  bool okTime = waitTimeSync(NTP_TIMEOUT);
+  endStage(STAGE_NTP);
+  if (!okTime)
+  {
+    Serial.println("Error : cannot obtain current time");
+#ifdef DEEP_SLEEP_SCHEDULER
+    sleepUntilNextWake();  // Retry later
+#endif
+    return;
+  }
+  updateTokenExpiry();
 
   // Current day Tempo color
-  Serial.println("\nGET CURRENT DAY TEMPO COLOR");
+  Serial.println("\nGET CURRENT DAY AND NEXT DAY TEMPO COLORS");
   tm time;
-  getLocalTime(&time);
+  toLocalTime(::time(nullptr), &time);
   int year = time.tm_year+1900;
   int month = time.tm_mon+1;
   int day = time.tm_mday;
+  long today = dayNumber(year, month, day);
+  startStage();
+  if (!prefetchSeason(today)) Serial.println("Error : incomplete season prefetch");
   Serial.printf("%d/%d/%d :\n", day, month, year);
-  if (getTempoDayColor(year, month, day , &token, &color)) Serial.printf("Day J Tempo color : %s\n", color.c_str());
-  if (getTempoDayColor(year, month, day+2 , &token, &color)) Serial.printf("Day J+2 Tempo color : %s\n", color.c_str());
+  bool okToday = getTempoColorRange(year, month, day, year, month, day+2, days, 2, &nDays);
+  endStage(STAGE_CALENDAR);
+  if (okToday)
+  {
+    for (int i = 0; i < nDays; i++) Serial.printf("%s Tempo color : %s\n", days[i].date, colorName(days[i].color));
+    if (nDays < 2) Serial.println("Day J+1 Tempo color : UNDEFINED");
+  }
+  else Serial.println("Error : cannot obtain Tempo colors");
+
+  // Current tariff, from the lookahead table
+  buildLookahead(today);
+  bool peak;
+  TempoColor color = colorAt(::time(nullptr), &peak);
+  Serial.printf("Current tariff : %s %s\n", colorName(color), peak ? "HP" : "HC");
+
+  // Season statistics, without any request
+  int counts[4];
+  countSeasonColors(today, counts);
+  Serial.printf("Season : %d BLUE, %d WHITE, %d RED days (remaining %d WHITE, %d RED)\n", counts[1], counts[2], counts[3], SEASON_WHITE_DAYS-counts[2], SEASON_RED_DAYS-counts[3]);
+
+#ifdef MQTT_PUBLISH
+  // Changed colors to the MQTT broker (before a deep sleep : wait for the connection and the acknowledgements)
+  waitMqtt(MQTT_TIMEOUT);
+  publishColors(today);
+  publishHeartbeat();
+#ifdef DEEP_SLEEP_SCHEDULER
+  waitPublished(MQTT_TIMEOUT);
+#endif
+#endif
+#ifdef METRICS
+  printMetrics(Serial);
+#endif
+  printHealth(Serial);
+#ifdef DEBUG_PRINT
+  Serial.printf("JSON arena high-water mark : %u/%u bytes\n", jsonAllocator.highWater(), jsonAllocator.size());
+#endif
+
+#ifdef DEEP_SLEEP_SCHEDULER
+  sleepUntilNextWake();
+#else
+  endWake(0);
+#endif
 }
 
 void loop()
 {
+#ifdef LAN_SERVER
+  server.handleClient();
+#endif
+#ifdef TEMPO_SERVICE_TASK
+  // Application (core 1) : never blocks on the Tempo service
+  TempoDay update;
+  while (xQueueReceive(updateQueue, &update, 0) == pdTRUE) Serial.printf("%s Tempo color : %s\n", update.date, colorName(update.color));
+#endif
+#ifdef TEMPO_SERVICE_TASK
+  // Long running service
+  static unsigned long lastHealth = 0;
+  if (millis() - lastHealth >= HEALTH_PERIOD)
+  {
+    lastHealth = millis();
+    printHealth(Serial);
+#ifdef METRICS
+    printMetrics(Serial);
+#endif
+  }
+  delay(2);
+#endif
 }
\ No newline at end of file